@@ -0,0 +1,312 @@
+#ifndef INC_BIN_H_
+#define INC_BIN_H_
+
+#include <cstdint>
+#include <cassert>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <math.h>
+#include "simd.h"
+#include "parallel.h"
+
+/*
+
+  Reduces millions of raw samples to a few thousand keyed records before
+  calling data(), like d3-array bin and rollup.
+
+    bin::CHistogram hist;
+    hist.width(0.5f);
+    std::vector< bin::TBin > bins;
+    hist(xs, values, nsamples, bins);
+    dv.data(bins);
+
+  The key of each bin is floor((x - origin) / width), which does not depend
+  on the samples, so the same bin gets the same key on each refresh and
+  the enter/update/exit selections work as expected. Use niceWidth to get
+  a width which does not change with small changes of the extent.
+
+  Samples are split in one chunk per core. Each chunk accumulates on its
+  own bins and the chunks are merged at the end.
+
+*/
+
+namespace bin {
+
+  // ---------------------------------------------------------
+  // Count, sum, min and max of the values in a bin/group
+  struct TAccum {
+    uint32_t count = 0;
+    float    sum = 0.f;
+    float    min = FLT_MAX;
+    float    max = -FLT_MAX;
+
+    void add(float v) {
+      ++count;
+      sum += v;
+      if (v < min) min = v;
+      if (v > max) max = v;
+    }
+    void merge(const TAccum& other) {
+      count += other.count;
+      sum += other.sum;
+      if (other.min < min) min = other.min;
+      if (other.max > max) max = other.max;
+    }
+    float mean() const { return count ? sum / count : 0.f; }
+  };
+
+  // ---------------------------------------------------------
+  struct TBin : public TAccum {
+    int64_t key = 0;        // floor((x - origin) / width)
+    float   x0 = 0.f;       // Bin covers [x0, x1)
+    float   x1 = 0.f;
+    bool operator==(const TBin& other) const { return key == other.key; }
+    bool operator<(const TBin& other) const { return key < other.key; }
+  };
+
+  template< typename TKey >
+  struct TAggregate : public TAccum {
+    TKey key;
+    bool operator==(const TAggregate& other) const { return key == other.key; }
+    bool operator<(const TAggregate& other) const { return key < other.key; }
+  };
+
+  namespace internal {
+
+    // NaNs and infinities are skipped
+    inline void minMax(const float* x, uint32_t n, float& out_min, float& out_max) {
+      float lo = FLT_MAX;
+      float hi = -FLT_MAX;
+      uint32_t i = 0;
+#if D3CPP_USE_SSE
+      __m128 vlo = _mm_set1_ps(lo);
+      __m128 vhi = _mm_set1_ps(hi);
+      const __m128 vabs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+      const __m128 vmax = _mm_set1_ps(FLT_MAX);
+      for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(x + i);
+        // |v| <= FLT_MAX is false for NaNs and infinities. Those lanes keep lo/hi
+        __m128 finite = _mm_cmple_ps(_mm_and_ps(v, vabs), vmax);
+        vlo = _mm_or_ps(_mm_and_ps(finite, _mm_min_ps(v, vlo)), _mm_andnot_ps(finite, vlo));
+        vhi = _mm_or_ps(_mm_and_ps(finite, _mm_max_ps(v, vhi)), _mm_andnot_ps(finite, vhi));
+      }
+      alignas(16) float tlo[4], thi[4];
+      _mm_store_ps(tlo, vlo);
+      _mm_store_ps(thi, vhi);
+      for (int j = 0; j < 4; ++j) {
+        if (tlo[j] < lo) lo = tlo[j];
+        if (thi[j] > hi) hi = thi[j];
+      }
+#endif
+      for (; i < n; ++i) {
+        if (!(fabsf(x[i]) <= FLT_MAX))
+          continue;
+        if (x[i] < lo) lo = x[i];
+        if (x[i] > hi) hi = x[i];
+      }
+      out_min = lo;
+      out_max = hi;
+    }
+
+    // Accumulates the samples in [lo,hi) in bins[ floor((x - origin) * inv_width) - kmin ].
+    // Computed in double so the keys match the ones of the scalar code exactly.
+    // lo and hi must be finite, so NaNs and infinities are never inside
+    inline void accumulate(const float* x, const float* values, uint32_t n, double origin, double inv_width, int64_t kmin, float lo, float hi, TAccum* bins, uint32_t nbins) {
+      auto addSample = [&](uint32_t i, int32_t idx) {
+        if (idx < 0) idx = 0;
+        if (idx >= (int32_t)nbins) idx = nbins - 1;
+        bins[idx].add(values ? values[i] : 1.f);
+      };
+      assert(fabsf(lo) <= FLT_MAX && fabsf(hi) <= FLT_MAX);
+      uint32_t i = 0;
+#if D3CPP_USE_SSE
+      __m128d vorigin = _mm_set1_pd(origin);
+      __m128d vinv = _mm_set1_pd(inv_width);
+      __m128d vkmin = _mm_set1_pd((double)kmin);
+      __m128 vlo = _mm_set1_ps(lo);
+      __m128 vhi = _mm_set1_ps(hi);
+      alignas(16) int32_t idx[4];
+      for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(x + i);
+        int inside = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(v, vlo), _mm_cmplt_ps(v, vhi)));
+        if (!inside)
+          continue;
+        // Relative indices are >= 0, so truncating is the same as floor
+        __m128d rel01 = _mm_sub_pd(_mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(v), vorigin), vinv), vkmin);
+        __m128d rel23 = _mm_sub_pd(_mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), vorigin), vinv), vkmin);
+        _mm_store_si128((__m128i*)idx, _mm_unpacklo_epi64(_mm_cvttpd_epi32(rel01), _mm_cvttpd_epi32(rel23)));
+        for (int j = 0; j < 4; ++j)
+          if (inside & (1 << j))
+            addSample(i + j, idx[j]);
+      }
+#endif
+      for (; i < n; ++i) {
+        float v = x[i];
+        if (v >= lo && v < hi)
+          addSample(i, (int32_t)((v - origin) * inv_width - (double)kmin));
+      }
+    }
+  }
+
+  // ---------------------------------------------------------
+  // 1, 2 or 5 times a power of 10, giving about count bins for [lo,hi]
+  inline float niceWidth(float lo, float hi, uint32_t count) {
+    double span = (double)hi - (double)lo;
+    if (!(span > 0.) || count == 0)
+      return 1.f;
+    double step = span / count;
+    double power = pow(10., floor(log10(step)));
+    double error = step / power;
+    if (error >= 7.071) power *= 10.;      // sqrt(50)
+    else if (error >= 3.162) power *= 5.;  // sqrt(10)
+    else if (error >= 1.414) power *= 2.;  // sqrt(2)
+    return (float)power;
+  }
+
+  // ---------------------------------------------------------
+  // Groups the samples 0..n-1 by key_fn(i) and aggregates value_fn(i) of each
+  // group. out gets one record per key, sorted by key
+  template< typename TKeyFn, typename TValueFn, typename TKey >
+  void rollup(uint32_t n, TKeyFn key_fn, TValueFn value_fn, std::vector< TAggregate< TKey > >& out) {
+    typedef std::unordered_map< TKey, TAccum > TGroups;
+    uint32_t nchunks = parallel::numChunks(n);
+    std::vector< TGroups > chunk_groups(nchunks);
+    parallel::forRange(n, [&](uint32_t begin, uint32_t end, uint32_t c) {
+      TGroups& groups = chunk_groups[c];
+      for (uint32_t i = begin; i < end; ++i)
+        groups[key_fn(i)].add(value_fn(i));
+    });
+
+    TGroups& groups = chunk_groups[0];
+    for (uint32_t c = 1; c < nchunks; ++c)
+      for (auto& it : chunk_groups[c])
+        groups[it.first].merge(it.second);
+
+    out.clear();
+    out.reserve(groups.size());
+    for (auto& it : groups) {
+      TAggregate< TKey > a;
+      static_cast<TAccum&>(a) = it.second;
+      a.key = it.first;
+      out.push_back(a);
+    }
+    std::sort(out.begin(), out.end());
+  }
+
+  // ---------------------------------------------------------
+  // Fixed width bins
+  class CHistogram {
+    float    bin_width = 1.f;
+    float    bin_origin = 0.f;
+    bool     has_domain = false;
+    float    domain_lo = 0.f;
+    float    domain_hi = 0.f;
+    uint32_t max_dense_bins = 1 << 18;
+
+  public:
+    CHistogram& width(float new_width) {
+      assert(new_width > 0.f);
+      bin_width = new_width;
+      return *this;
+    }
+
+    CHistogram& origin(float new_origin) {
+      bin_origin = new_origin;
+      return *this;
+    }
+
+    // Only the samples in [lo,hi) are binned. By default all the finite samples
+    CHistogram& domain(float lo, float hi) {
+      assert(fabsf(lo) <= FLT_MAX && fabsf(hi) <= FLT_MAX);
+      has_domain = true;
+      domain_lo = lo;
+      domain_hi = hi;
+      return *this;
+    }
+
+    // Samples spread over more bins than this are grouped by key with a hash map
+    CHistogram& maxDenseBins(uint32_t new_max) {
+      max_dense_bins = new_max;
+      return *this;
+    }
+
+    // Bins the n samples x. values can be null to just count the samples.
+    // out gets the non empty bins, sorted by key
+    void operator()(const float* x, const float* values, uint32_t n, std::vector< TBin >& out) const {
+      out.clear();
+
+      float lo = domain_lo;
+      float hi = domain_hi;
+      if (!has_domain) {
+        uint32_t nchunks = parallel::numChunks(n);
+        std::vector< float > chunk_lo(nchunks), chunk_hi(nchunks);
+        parallel::forRange(n, [&](uint32_t begin, uint32_t end, uint32_t c) {
+          internal::minMax(x + begin, end - begin, chunk_lo[c], chunk_hi[c]);
+        });
+        lo = *std::min_element(chunk_lo.begin(), chunk_lo.end());
+        hi = *std::max_element(chunk_hi.begin(), chunk_hi.end());
+        if (lo > hi)
+          return;
+        // Include the max sample
+        hi = nextafterf(hi, FLT_MAX);
+      }
+      if (!(lo < hi))
+        return;
+
+      double inv_width = 1. / bin_width;
+      int64_t kmin = (int64_t)floor((lo - (double)bin_origin) * inv_width);
+      int64_t kmax = (int64_t)floor((hi - (double)bin_origin) * inv_width);
+      uint64_t nbins = (uint64_t)(kmax - kmin + 1);
+
+      if (nbins > max_dense_bins) {
+        std::vector< TAggregate< int64_t > > groups;
+        float origin = bin_origin;
+        rollup(n, [=](uint32_t i) {
+          float v = x[i];
+          return (v >= lo && v < hi) ? (int64_t)floor((v - (double)origin) * inv_width) : INT64_MIN;
+        }, [values](uint32_t i) {
+          return values ? values[i] : 1.f;
+        }, groups);
+        out.reserve(groups.size());
+        for (auto& g : groups) {
+          if (g.key == INT64_MIN)
+            continue;
+          TBin b;
+          static_cast<TAccum&>(b) = g;
+          setKey(b, g.key);
+          out.push_back(b);
+        }
+        return;
+      }
+
+      uint32_t nchunks = parallel::numChunks(n);
+      std::vector< TAccum > chunk_bins(nchunks * nbins);
+      parallel::forRange(n, [&](uint32_t begin, uint32_t end, uint32_t c) {
+        internal::accumulate(x + begin, values ? values + begin : nullptr, end - begin
+          , bin_origin, inv_width, kmin, lo, hi, chunk_bins.data() + c * nbins, (uint32_t)nbins);
+      });
+
+      for (uint32_t k = 0; k < nbins; ++k) {
+        TBin b;
+        for (uint32_t c = 0; c < nchunks; ++c)
+          b.merge(chunk_bins[c * nbins + k]);
+        if (!b.count)
+          continue;
+        setKey(b, kmin + k);
+        out.push_back(b);
+      }
+    }
+
+  private:
+    void setKey(TBin& b, int64_t key) const {
+      b.key = key;
+      b.x0 = (float)(bin_origin + key * (double)bin_width);
+      b.x1 = (float)(bin_origin + (key + 1) * (double)bin_width);
+    }
+  };
+
+}
+
+#endif
@@ -1,5 +1,14 @@
 #include "data_visualizer.h"
+#include "trace.h"
+#include "force.h"
+#include "scale.h"
+#include "bin.h"
+#include "lod.h"
+#include "shape.h"
 #include <string>
+#include <cstring>
+#include <thread>
+#include <iostream>
 
 // -----------------------------------------------------------
 // -----------------------------------------------------------
@@ -19,13 +28,13 @@ struct TVisual {
   }
   template< typename TPropType >
   TPropType get(uint32_t prop_id);
-
-  template<>
-  float get<float>(uint32_t prop_id) {
-    return k;
-  }
 };
 
+template<>
+float TVisual::get<float>(uint32_t prop_id) {
+  return k;
+}
+
 struct TUserData {
   const char* name;
   int         key;
@@ -93,7 +102,302 @@ public:
   }
 };
 
-#include <iostream>
+// -----------------------------------------------------------
+// -----------------------------------------------------------
+// Demos of the features, with a visual holding a position and a size
+enum { PROP_POS, PROP_SIZE };
+
+struct TPoint {
+  tween::TVec2 pos;
+  float        size;
+  TPoint() : pos{ 0.f, 0.f }, size(0.f) {}
+  void destroy() {
+    size = -1.f;
+  }
+  void set(uint32_t prop_id, const tween::TVec2& new_pos) {
+    pos = new_pos;
+  }
+  void set(uint32_t prop_id, float new_size) {
+    size = new_size;
+  }
+  template< typename TPropType >
+  TPropType get(uint32_t prop_id);
+};
+
+template<>
+tween::TVec2 TPoint::get<tween::TVec2>(uint32_t prop_id) {
+  return pos;
+}
+
+template<>
+float TPoint::get<float>(uint32_t prop_id) {
+  return size;
+}
+
+struct TItem {
+  int   key;
+  float value;
+  bool operator == (const TItem& other) const {
+    return key == other.key;
+  }
+  bool operator < (const TItem& other) const {
+    return key < other.key;
+  }
+};
+
+typedef CDataVisualizer< TItem, TPoint > CPoints;
+
+std::vector< TItem > makeItems(int first, int count) {
+  std::vector< TItem > items;
+  for (int i = first; i < first + count; ++i)
+    items.push_back({ i, (float)(i % 10) });
+  return items;
+}
+
+void dumpSizes(const char* title, CPoints& d) {
+  printf("  %-8s:", title);
+  d.enter().merge(d.updated()).each([](const TItem&, uint32_t, const TPoint& p) {
+    printf(" %5.2f", p.size);
+  });
+  printf("\n");
+}
+
+// -----------------------------------------------------------
+void demoAsync() {
+  printf("dataAsync\n");
+  CPoints d;
+  d.dataAsync(makeItems(0, 1000), [&d](CPoints::CSelection&) {
+    printf("  applied, %d entered\n", d.enter().size());
+  });
+  // Only the most recent of the queued binds is applied
+  d.dataAsync(makeItems(500, 10));
+  d.dataAsync(makeItems(995, 10));
+  int frames = 0;
+  while (d.isJoinPending()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    d.update(1.f / 60.f);
+    ++frames;
+  }
+  printf("  %d frames, enter %d updated %d exit %d\n", frames, d.enter().size(), d.updated().size(), d.exit().size());
+}
+
+// -----------------------------------------------------------
+void demoTrace() {
+  printf("Trace record and replay\n");
+  const char* filename = "d3cpp.trace";
+  {
+    CPoints d;
+    trace::CRecorder recorder;
+    if (!recorder.open(filename, sizeof(TItem))) {
+      printf("  Can't create %s\n", filename);
+      return;
+    }
+    d.setRecorder(&recorder);
+    auto items = makeItems(0, 5);
+    d.data(items);
+    d.enter().set(PROP_SIZE, [](const TItem& item, uint32_t) { return item.value; });
+    d.enter().transition().duration(0.3f).set(PROP_SIZE, [](const TItem& item, uint32_t) { return item.value * 2.f; });
+    for (int i = 0; i < 4; ++i)
+      d.update(0.1f);
+    auto next = makeItems(2, 5);
+    d.data(next);
+    d.exit().transition().remove();
+    for (int i = 0; i < 4; ++i)
+      d.update(0.1f);
+    d.setRecorder(nullptr);
+    dumpSizes("recorded", d);
+  }
+  CPoints d;
+  trace::CReplayer< CPoints > replayer;
+  replayer.registerPropType< float >();
+  trace::TReplayStats stats;
+  if (!replayer.run(filename, d, stats)) {
+    printf("  Can't replay %s\n", filename);
+    return;
+  }
+  dumpSizes("replayed", d);
+  stats.dump();
+  remove(filename);
+}
+
+// -----------------------------------------------------------
+void demoChain() {
+  printf("Chained transitions\n");
+  CPoints d;
+  auto items = makeItems(0, 4);
+  d.data(items);
+  d.enter()
+    .transition()
+    .duration(0.2f)
+    .ease(ease::linear)
+    .delay([](const TItem&, uint32_t idx) { return idx * 0.1f; })
+    .setCte(PROP_SIZE, 10.f)
+    .transition()
+    .setCte(PROP_SIZE, 5.f);
+  for (int i = 0; i < 8; ++i) {
+    d.update(0.1f);
+    dumpSizes("size", d);
+  }
+}
+
+// -----------------------------------------------------------
+void demoForce() {
+  printf("Force layout\n");
+  const uint32_t n = 200;
+  force::CSimulation sim;
+  sim.resize(n);
+  std::vector< force::TLink > links;
+  for (uint32_t i = 1; i < n; ++i) {
+    force::TLink l;
+    l.source = (i - 1) / 2;
+    l.target = i;
+    links.push_back(l);
+  }
+  sim.setLinks(links).manyBody(-30.f).center(0.f, 0.f).collide(1.f);
+  for (auto& nd : sim.getNodes())
+    nd.radius = 4.f;
+
+  CPoints d;
+  auto items = makeItems(0, (int)n);
+  d.data(items);
+  int ticks = 0;
+  while (sim.isActive()) {
+    sim.tick();
+    ++ticks;
+  }
+  d.enter().set(PROP_POS, sim.positions([](const TItem& item) { return item.key; }));
+  float x0 = FLT_MAX, x1 = -FLT_MAX;
+  d.enter().each([&](const TItem&, uint32_t, const TPoint& p) {
+    x0 = std::min(x0, p.pos.x);
+    x1 = std::max(x1, p.pos.x);
+  });
+  printf("  %d ticks, x in [%1.1f, %1.1f]\n", ticks, x0, x1);
+}
+
+// -----------------------------------------------------------
+void demoSpatial() {
+  printf("Spatial index\n");
+  CPoints d;
+  auto items = makeItems(0, 100);
+  d.data(items);
+  d.enter().set(PROP_POS, [](const TItem& item, uint32_t) {
+    return tween::TVec2{ (float)(item.key % 10) * 10.f, (float)(item.key / 10) * 10.f };
+  });
+  d.spatialIndex(PROP_POS);
+  d.find(42.f, 67.f, 5.f).each([](const TItem& item, uint32_t, const TPoint& p) {
+    printf("  find    : %d at %1.0f,%1.0f\n", item.key, p.pos.x, p.pos.y);
+  });
+  printf("  within  : %d\n", d.within(0.f, 0.f, 30.f, 20.f).size());
+
+  // Move them right, the index follows the tweens
+  d.enter().transition().duration(0.2f).set(PROP_POS, [](const TItem& item, uint32_t) {
+    return tween::TVec2{ (float)(item.key % 10) * 10.f + 1000.f, (float)(item.key / 10) * 10.f };
+  });
+  for (int i = 0; i < 3; ++i)
+    d.update(0.1f);
+  printf("  moved   : %d left, %d right\n", d.within(0.f, 0.f, 100.f, 100.f).size(), d.within(1000.f, 0.f, 1100.f, 100.f).size());
+}
+
+// -----------------------------------------------------------
+void demoScales() {
+  printf("Scales\n");
+  scale::CLinear x;
+  x.domain(0.f, 10.f).range(0.f, 100.f);
+  scale::CLog y;
+  y.domain(1.f, 1000.f).range(0.f, 3.f);
+  scale::CBand band;
+  band.domain(4).range(0.f, 100.f).padding(0.1f);
+  printf("  linear  : %1.2f log : %1.2f band : %1.2f\n", x(2.5f), y(100.f), band(1.f));
+
+  // Bound items transition when the domain changes
+  CPoints d;
+  auto items = makeItems(0, 5);
+  d.data(items);
+  d.bindScale(PROP_SIZE, x, [](const TItem& item) { return item.value; }, 0.2f);
+  dumpSizes("bound", d);
+  x.domain(0.f, 5.f);
+  for (int i = 0; i < 3; ++i)
+    d.update(0.1f);
+  dumpSizes("rescaled", d);
+  d.unbindScale(PROP_SIZE);
+}
+
+// -----------------------------------------------------------
+void demoBins() {
+  printf("Bins\n");
+  const uint32_t n = 100000;
+  std::vector< float > xs;
+  for (uint32_t i = 0; i < n; ++i)
+    xs.push_back((float)(i % 1000) * 0.01f);
+  // Not finite samples are skipped
+  xs.push_back(INFINITY);
+  bin::CHistogram hist;
+  hist.width(bin::niceWidth(0.f, 10.f, 4));
+  std::vector< bin::TBin > bins;
+  hist(xs.data(), nullptr, (uint32_t)xs.size(), bins);
+  for (auto& b : bins)
+    printf("  [%4.1f, %4.1f) : %u\n", b.x0, b.x1, b.count);
+
+  std::vector< bin::TAggregate< int > > groups;
+  bin::rollup(n, [](uint32_t i) { return (int)(i % 3); }, [&xs](uint32_t i) { return xs[i]; }, groups);
+  for (auto& g : groups)
+    printf("  group %d : %u mean %1.3f\n", g.key, g.count, g.mean());
+}
+
+// -----------------------------------------------------------
+void demoLod() {
+  printf("Level of detail\n");
+  std::vector< float > xs, ys;
+  for (int i = 0; i < 1000000; ++i) {
+    xs.push_back((float)i);
+    ys.push_back(sinf(i * 0.001f));
+  }
+  lod::CPyramid pyramid;
+  pyramid.build(xs.data(), ys.data(), (uint32_t)xs.size());
+  CDataVisualizer< lod::TMark, TPoint > d;
+  lod::CView view;
+  float span = 1000000.f;
+  for (int zoom = 0; zoom < 4; ++zoom, span *= 0.1f) {
+    bool changed = view.update(d, pyramid, 500000.f - span * 0.5f, 500000.f + span * 0.5f, 800);
+    printf("  span %8.0f : rebind %d level %u enter %d updated %d exit %d\n", span, changed, view.getLevel()
+      , d.enter().size(), d.updated().size(), d.exit().size());
+    if (changed)
+      d.exit().remove();
+  }
+}
+
+// -----------------------------------------------------------
+void demoShapes() {
+  printf("Shapes\n");
+  std::vector< tween::TVec2 > pts;
+  for (int i = 0; i < 8; ++i)
+    pts.push_back(tween::TVec2{ i * 10.f, (float)(i % 3) * 5.f });
+  shape::CLine line;
+  line.width(2.f).curve(shape::CURVE_MONOTONE_X, 4);
+  line.update(pts.data(), (uint32_t)pts.size());
+  printf("  line    : %d vertices, %d dirty ranges\n", (int)line.vertices().size(), (int)line.dirtyRanges().size());
+  // Only the spans around the moved point are generated again
+  pts[4].y += 1.f;
+  line.update(pts.data(), (uint32_t)pts.size());
+  for (auto& r : line.dirtyRanges())
+    printf("  dirty   : %u + %u\n", r.first, r.count);
+
+  shape::CArea area;
+  area.baseline(0.f);
+  area.update(pts.data(), (uint32_t)pts.size());
+  printf("  area    : %d vertices\n", (int)area.vertices().size());
+
+  std::vector< shape::TArc > arcs = {
+    { 0.f, 1.f, 20.f, 40.f },
+    { 1.f, 4.f, 20.f, 40.f },
+    { 4.f, 6.28f, 20.f, 40.f },
+  };
+  shape::CArc pie;
+  pie.center(50.f, 50.f).subdivisions(16);
+  pie.update(arcs.data(), (uint32_t)arcs.size());
+  printf("  arcs    : %d vertices\n", (int)pie.vertices().size());
+}
+
 float getFloat() {
   return 11.f;
 }
@@ -169,6 +473,16 @@ int main()
     }
   }
 
+  demoAsync();
+  demoTrace();
+  demoChain();
+  demoForce();
+  demoSpatial();
+  demoScales();
+  demoBins();
+  demoLod();
+  demoShapes();
+
   return 0;
 }
 
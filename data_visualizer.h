@@ -4,15 +4,19 @@
 #include <cstdio>
 #include <cstdint>
 #include <cassert>
+#include <cfloat>
 #include <algorithm>
 #include <iterator>
 #include <vector>
+#include <functional>
+#include <future>
+#include <chrono>
 
 /*
 
   TODO:
     + Split in several files: ease, tween, data_viz
-    - chain transitions
+    + chain transitions
     - fix problem setCte vs set
     - send events when transition finishes/stars
     - remove indata when no more refs required
@@ -22,6 +26,9 @@
 
 #include "ease.h"
 #include "tween.h"
+#include "trace.h"
+#include "quadtree.h"
+#include "scale.h"
 
 // ----------------------------------------
 template< typename TUserData, typename TVisualData >
@@ -37,12 +44,34 @@ class CDataVisualizer {
   // -----------------------------------------------------------------
   // Forward get/set property access to the visual data object
   template< typename TPropType >
-  void setPropValue(TIndex user_data_idx, uint32_t prop_id, TPropType new_value) {
+  void setPropValue(TIndex user_data_idx, uint32_t prop_id, const TPropType& new_value) {
     all_visual_data[user_data_idx].set(prop_id, new_value);
+    onPropChanged(user_data_idx, prop_id, new_value);
   }
   template< typename TPropType >
   TPropType getPropValue(TIndex user_data_idx, uint32_t prop_id) {
-    return all_visual_data[user_data_idx].get<TPropType>(prop_id);
+    return all_visual_data[user_data_idx].template get<TPropType>(prop_id);
+  }
+
+  // Keep the spatial index in sync with the writes to the position prop
+  template< typename TPropType >
+  void onPropChanged(TIndex, uint32_t, const TPropType&) {
+  }
+  void onPropChanged(TIndex user_data_idx, uint32_t prop_id, const tween::TVec2& new_value) {
+    if (prop_id == spatial_prop_id)
+      spatial_index.update(user_data_idx, new_value.x, new_value.y);
+  }
+
+  // Reads the position of user_data_idx back from its visual. Only called
+  // through spatial_index_fn, so visuals without a tween::TVec2 prop compile
+  void indexVisual(TIndex user_data_idx) {
+    tween::TVec2 p = getPropValue< tween::TVec2 >(user_data_idx, spatial_prop_id);
+    spatial_index.update(user_data_idx, p.x, p.y);
+  }
+
+  void destroyVisual(TIndex user_data_idx) {
+    all_visual_data[user_data_idx].destroy();
+    spatial_index.remove(user_data_idx);
   }
 
   // -----------------------------------------------------------------
@@ -52,8 +81,18 @@ class CDataVisualizer {
   // A template to tween different types
   template< typename TPropType >
   void setTweenedData(TIndex user_data_idx, uint32_t prop_id, float t, const void* v01_addr ) {
-    const TPropType* v01 = reinterpret_cast<const TPropType*>(v01_addr);
-    setPropValue< TPropType >(user_data_idx, prop_id, tween::tweenData<TPropType>(t, v01[0], v01[1]));
+    const TTweenData< TPropType >* v01 = reinterpret_cast<const TTweenData< TPropType >*>(v01_addr);
+    setPropValue< TPropType >(user_data_idx, prop_id, v01->blend(t));
+  }
+
+  // A fn to read the current value as the initial value of the tween
+  using TCaptureTweenedDataFn = void (CDataVisualizer::*)(TIndex, uint32_t, void*);
+
+  template< typename TPropType >
+  void captureTweenedData(TIndex user_data_idx, uint32_t prop_id, void* v01_addr) {
+    TTweenData< TPropType >* v01 = reinterpret_cast<TTweenData< TPropType >*>(v01_addr);
+    v01->value_t0 = getPropValue< TPropType >(user_data_idx, prop_id);
+    v01->prepare();
   }
 
   // -----------------------------------------------------------------
@@ -68,51 +107,85 @@ class CDataVisualizer {
     ease::TEaseFn     ease_fn;            // Type of blending
     TSetTweenedDataFn tween_fn;           // Pointer to blend two values and set destination
     uint32_t          offset_to_data;     // Offset to the two consecutive data values to tween
+    TCaptureTweenedDataFn capture_fn;     // When not null, the initial value is read when the tween starts
   };
   std::vector< TTweenValue > tweens;
 
+  // The initial and final values, plus whatever the type precomputes from them
   template< typename TPropValueType >
-  struct TTweenData {
-    TPropValueType  value_t0;           // initial value
-    TPropValueType  value_t1;           // final value
-  };
-  std::vector< uint8_t >     tweens_data;
+  using TTweenData = tween::TEndpoints< TPropValueType >;
+  // Aligned, so each TTweenData can be read directly by the SIMD tween kernels
+  typedef std::vector< uint8_t, simd::TAlignedAllocator< uint8_t > > TTweensDataContainer;
+  TTweensDataContainer       tweens_data;
+
+  // Indices of the chained tweens starting in the current frame
+  std::vector< TIndex > starting_chained;
+
+  // -------------------------------------------------------
+  // Returns false if the tween has finished and removed its visual
+  bool applyTween(TTweenValue& tw, float unit_time) {
+    if (unit_time < 1.f) {
+      unit_time = tw.ease_fn(unit_time);
+    }
+    else {
+      unit_time = 1.f;
+      // disable this
+      tw.start_delay = -1.f;
+      tw.completed = true;
+
+      // notify end of the transition
+      if (tw.remove_on_end) {
+        // Should we at least render one time with the full blend?
+        destroyVisual(tw.user_data_idx);
+        return false;
+      }
+    }
+
+    const void* src_data = &tweens_data[tw.offset_to_data];
+
+    (this->*tw.tween_fn)(tw.user_data_idx, tw.prop_id, unit_time, src_data);
+    return true;
+  }
 
   // -------------------------------------------------------
   bool updateTweens(float dt) {
     int nactives = 0;
+    starting_chained.clear();
 
-    for (auto& tw : tweens) {
+    for (TIndex i = 0; i < (TIndex)tweens.size(); ++i) {
+      auto& tw = tweens[i];
 
       if (tw.completed)
         continue;
 
       float unit_time = (current_time - tw.start_delay) / tw.duration;
-      if (unit_time < 0.f)
+      if (unit_time < 0.f) {
+        // Still waiting, but keep it alive
+        ++nactives;
         continue;
-
-      if (unit_time < 1.f) {
-        unit_time = tw.ease_fn(unit_time);
-      }
-      else {
-        unit_time = 1.f;
-        // disable this
-        tw.start_delay = -1.f;
-        tw.completed = true;
-
-        // notify end of the transition
-        if (tw.remove_on_end) {
-          // Should we at least render one time with the full blend?
-          all_visual_data[tw.user_data_idx].destroy();
-          continue;
-        }
       }
 
-      const void* src_data = &tweens_data[tw.offset_to_data];
+      // Chained tweens start from whatever value the previous stage left,
+      // so they start once all the other tweens have been applied
+      if (tw.capture_fn) {
+        starting_chained.push_back(i);
+        ++nactives;
+        continue;
+      }
 
-      (this->*tw.tween_fn)(tw.user_data_idx, tw.prop_id, unit_time, src_data);
+      if (applyTween(tw, unit_time))
+        ++nactives;
+    }
 
-      ++nactives;
+    // Earlier stages first, in case several stages start in the same frame
+    std::stable_sort(starting_chained.begin(), starting_chained.end(), [this](TIndex a, TIndex b) {
+      return tweens[a].start_delay < tweens[b].start_delay;
+    });
+    for (auto i : starting_chained) {
+      auto& tw = tweens[i];
+      (this->*tw.capture_fn)(tw.user_data_idx, tw.prop_id, &tweens_data[tw.offset_to_data]);
+      tw.capture_fn = nullptr;
+      applyTween(tw, (current_time - tw.start_delay) / tw.duration);
     }
 
     // Delete everything
@@ -124,6 +197,137 @@ class CDataVisualizer {
     return nactives > 0;
   }
 
+public:
+  class CSelection;
+
+private:
+  // -------------------------------------------------------
+  // Output of the join between the new data set and the bound data. Computing
+  // it only reads the visualizer, so it can run while other threads read the
+  // selections
+  struct TJoinResult {
+    TUserDataContainer                              new_user_data;      // Never seen before, will be appended to all_user_data
+    std::vector< std::pair< TIndex, TUserData > >  updated_user_data;  // Already known entries with the new contents
+    TVisualizedDataContainer                        enter;
+    TVisualizedDataContainer                        updated;
+    TVisualizedDataContainer                        exit;
+    TUserDataContainer                              input;              // The sorted new data, recorded when the join is applied
+  };
+
+  TJoinResult computeJoin(const TUserDataContainer& new_data) const {
+    TJoinResult join;
+
+    // By default all exit 
+    join.exit = s_enter.merge(s_updated).sort().data;
+
+    for (auto& nd : new_data) {
+
+      // Find user_data_idx for nd;
+      auto nd_iter = std::find(all_user_data.begin(), all_user_data.end(), nd);
+      TIndex data_idx = invalid_idx;
+
+      // If it does not exists in old_entries... it means it's really new, never seen before
+      if (nd_iter == all_user_data.end()) {
+
+        // It might have been registered by a previous entry of this same join
+        auto new_iter = std::find(join.new_user_data.begin(), join.new_user_data.end(), nd);
+        if (new_iter == join.new_user_data.end()) {
+          data_idx = (TIndex)(all_user_data.size() + join.new_user_data.size());
+          join.new_user_data.push_back(nd);
+        }
+        else {
+          data_idx = (TIndex)(all_user_data.size() + std::distance(join.new_user_data.begin(), new_iter));
+          *new_iter = nd;
+        }
+
+        // The new entry is entering the data_set
+        join.enter.push_back(data_idx);
+      }
+      else {
+        // We have seen this entry before. Find where
+        data_idx = (TIndex)std::distance(all_user_data.begin(), nd_iter);
+
+        // Update our copy with the updated data
+        join.updated_user_data.emplace_back(data_idx, nd);
+
+        // Now in terms if is new or no
+        auto it = std::find(join.exit.begin(), join.exit.end(), data_idx);
+        if (it == join.exit.end()) {
+          join.enter.push_back(data_idx);
+        }
+        else {
+          join.updated.push_back(data_idx);
+          join.exit.erase(it);
+        }
+      }
+
+    }
+
+    std::sort(join.enter.begin(), join.enter.end());
+    std::sort(join.updated.begin(), join.updated.end());
+
+    // At this point
+    //   exit contains the elems that were there but no longer are
+    //   enter contains the elems that were not there but now are
+    //   update contains the elems that were there and are
+    return join;
+  }
+
+  void applyJoin(TJoinResult& join) {
+    for (auto& u : join.updated_user_data)
+      all_user_data[u.first] = u.second;
+    all_user_data.insert(all_user_data.end(), join.new_user_data.begin(), join.new_user_data.end());
+    all_visual_data.resize(all_user_data.size());
+    s_enter.data.swap(join.enter);
+    s_updated.data.swap(join.updated);
+    s_exit.data.swap(join.exit);
+  }
+
+  // -------------------------------------------------------
+  typedef std::function< void(CSelection&) > TOnJoinAppliedFn;
+
+  void startJoin(TUserDataContainer new_data, TOnJoinAppliedFn on_applied) {
+    assert(!pending_join.valid());
+    pending_on_applied = on_applied;
+    // The bound data is not modified until the join is applied, so the
+    // worker can safely read it meanwhile.
+    // The input is always kept, as a recorder might be set before the join
+    // is applied
+    pending_join = std::async(std::launch::async, [this](TUserDataContainer snapshot) {
+      std::sort(snapshot.begin(), snapshot.end());
+      TJoinResult join = computeJoin(snapshot);
+      join.input.swap(snapshot);
+      return join;
+    }, std::move(new_data));
+  }
+
+  void applyPendingJoin() {
+    TJoinResult join = pending_join.get();
+    // Replayed as a regular data() call
+    if (recorder)
+      recorder->recordData(join.input);
+    applyJoin(join);
+    TOnJoinAppliedFn on_applied;
+    on_applied.swap(pending_on_applied);
+
+    // Start the next one before giving control to the user
+    if (has_queued_join) {
+      has_queued_join = false;
+      startJoin(std::move(queued_data), std::move(queued_on_applied));
+      queued_data.clear();
+    }
+
+    on_applied(s_updated);
+  }
+
+  // Blocks until no join is running in the background
+  void waitPendingJoin() {
+    while (pending_join.valid()) {
+      pending_join.wait();
+      applyPendingJoin();
+    }
+  }
+
 public:
 
   // -----------------------------------------
@@ -139,6 +343,21 @@ public:
       std::sort(data.begin(), data.end());
     }
 
+    // ----------------------------------------------------------------------
+    // Maps accessor(d) of all the items with a single call to the scale
+    template< typename TScale, typename TFn >
+    auto evalScale(const TScale& scale, TFn accessor) const {
+      typedef typename TScale::TInput TInput;
+      typedef decltype(scale(TInput())) TOutput;
+      std::vector< TInput > in;
+      in.reserve(data.size());
+      for (auto d : data)
+        in.push_back((TInput)accessor(dv->all_user_data[d]));
+      std::vector< TOutput > out(data.size());
+      scale.apply(in.data(), out.data(), (uint32_t)data.size());
+      return out;
+    }
+
   public:
 
     TIndex size() const { return (TIndex)data.size(); }
@@ -155,6 +374,19 @@ public:
       }
     }
 
+    // ----------------------------------------------------------------------
+    // Current value of prop_id of each item, in the order of the selection
+    template< typename TPropType >
+    void values(uint32_t prop_id, std::vector< TPropType >& out) const {
+      assert(isValid());
+      out.resize(data.size());
+      TIndex idx = 0;
+      for (auto d : data) {
+        out[idx] = dv->template getPropValue< TPropType >(d, prop_id);
+        ++idx;
+      }
+    }
+
     // ----------------------------------------------------------------------
     // Generates a new selection which just those items where the user data
     // passes the filter 
@@ -216,6 +448,8 @@ public:
       TIndex idx = 0;
       for (auto d : data) {
         dv->all_visual_data[d] = generator(dv->all_user_data[d], idx);
+        if (dv->spatial_index_fn)
+          (dv->*dv->spatial_index_fn)(d);
         ++idx;
       }
       return *this;
@@ -224,7 +458,7 @@ public:
     // ----------------------------------------------------------------------
     CSelection remove() const {
       for (auto d : data)
-        dv->all_visual_data[d].destroy();
+        dv->destroyVisual(d);
       return *this;
     }
 
@@ -238,18 +472,46 @@ public:
     const CSelection& set(uint32_t prop_id, TFn prop_value_provider) const {
 
       // Get the type of the value returned by the provided function
-      typedef typename decltype(prop_value_provider(TUserData(), 0)) TPropType;
+      typedef decltype(prop_value_provider(TUserData(), 0)) TPropType;
+
+      // Keep the values written, to record them
+      std::vector< TPropType, simd::TAlignedAllocator< TPropType > > recorded;
+      if (dv->recorder)
+        recorded.reserve(data.size());
 
       // All the registers entries will have the same prop_id
       TIndex idx = 0;
       for (auto d : data) {
         auto new_value = prop_value_provider(dv->all_user_data[d], idx);
         dv->setPropValue<TPropType>(d, prop_id, new_value);
+        if (dv->recorder)
+          recorded.push_back(new_value);
         ++idx;
       }
+
+      if (dv->recorder) {
+        trace::TSelectionSet ss;
+        ss.prop_type_id = trace::propTypeId<TPropType>();
+        ss.prop_id = prop_id;
+        ss.count = size();
+        ss.value_bytes = sizeof(TPropType);
+        dv->recorder->recordSelectionSet<TPropType, TIndex>(ss, [&](uint32_t i, TIndex& user_data_idx, TPropType& value) {
+          user_data_idx = data[i];
+          value = recorded[i];
+        });
+      }
       return *this;
     }
 
+    // -----------------------------------------------------------------
+    // Sets prop_id to scale( accessor(d) ). The scale is evaluated for the
+    // whole selection at once
+    template< typename TScale, typename TFn >
+    const CSelection& setScaled(uint32_t prop_id, const TScale& scale, TFn accessor) const {
+      auto values = evalScale(scale, accessor);
+      return set(prop_id, [&values](const TUserData&, TIndex idx) { return values[idx]; });
+    }
+
     // -----------------------------------------------------------------
     // -----------------------------------------------------------------
     // -----------------------------------------------------------------
@@ -258,14 +520,18 @@ public:
       float             default_delay = 0.f;
       float             default_duration = 0.25f;
       bool              default_remove_on_end = false;
+      bool              chained = false;            // Initial values are read when each tween starts
       TIndex            first_tween_idx = invalid_idx;
       ease::TEaseFn ease_fn = ease::cubic;
 
       friend class CSelection;
+      template< typename TVisualizer >
+      friend class trace::CReplayer;
 
       // Applied in the selection order
       struct TTweenBaseParam {
-        float     delay;
+        float     start_offset;     // When the previous transition in the chain ends
+        float     delay;            // Relative to start_offset
         float     duration;
       };
       std::vector< TTweenBaseParam > base_params;
@@ -280,6 +546,42 @@ public:
         alloc();
       }
 
+      // Follow-up of parent. Each element starts when it ends in the parent transition
+      struct TChainTag {};
+      CTransition(const CTransition& parent, TChainTag)
+        : selection(parent.selection)
+        , default_duration(parent.default_duration)
+        , chained(true)
+        , ease_fn(parent.ease_fn)
+        , base_params(parent.base_params)
+      {
+        for (auto& bp : base_params) {
+          bp.start_offset += bp.delay + bp.duration;
+          bp.delay = 0.f;
+        }
+      }
+
+      // Saves the tweens just registered by set starting at tween first_idx
+      template< typename TPropType >
+      void record(uint32_t prop_id, TIndex first_idx) {
+        const CDataVisualizer* dv = selection.dv;
+        trace::TTransitionSet ts;
+        ts.prop_type_id = trace::propTypeId<TPropType>();
+        ts.prop_id = prop_id;
+        ts.ease_type = ease::getType(ease_fn);
+        ts.remove_on_end = default_remove_on_end;
+        ts.chained = chained;
+        ts.count = selection.size();
+        ts.value_bytes = sizeof(TPropType);
+        dv->recorder->recordTransitionSet<TPropType, TIndex>(ts, [&](uint32_t i, TIndex& user_data_idx, float& delay, float& duration, TPropType& value) {
+          const TTweenValue& tw = dv->tweens[first_idx + i];
+          user_data_idx = tw.user_data_idx;
+          delay = base_params[i].start_offset + base_params[i].delay;
+          duration = base_params[i].duration;
+          value = reinterpret_cast<const TTweenData<TPropType>*>(&dv->tweens_data[tw.offset_to_data])->value_t1;
+        });
+      }
+
     public:
 
       // -----------------------------------------------------------
@@ -347,6 +649,9 @@ public:
           auto* tc = &selection.dv->tweens[first_tween_idx];
           for (TIndex n = selection.size(); n--; ++tc)
             tc->remove_on_end = true;
+
+          if (selection.dv->recorder)
+            selection.dv->recorder->recordRemove(first_tween_idx, selection.size());
         }
 
         return *this;
@@ -357,7 +662,7 @@ public:
       template< typename TFn >
       CTransition& set(uint32_t prop_id, TFn prop_value_provider ) {
         
-        typedef typename decltype(prop_value_provider(TUserData(), 0)) TPropType;
+        typedef decltype(prop_value_provider(TUserData(), 0)) TPropType;
 
         auto& tweens_container = selection.dv->tweens;
 
@@ -372,9 +677,10 @@ public:
         auto tc = tweens_container.begin() + i0;          // This is where we write our first tween
 
         // Reserve space for N tween data
+        static_assert(alignof(TTweenData<TPropType>) <= simd::default_alignment, "Prop type alignment not supported by the tweens storage");
         auto data_bytes_per_tween = sizeof(TTweenData<TPropType>);
         auto& tweens_data = selection.dv->tweens_data;
-        auto offset_to_data = tweens_data.size();
+        auto offset_to_data = simd::alignUp(tweens_data.size(), alignof(TTweenData<TPropType>));
         tweens_data.resize(offset_to_data + data_bytes_per_tween * selection.data.size());
         TTweenData<TPropType>* addr = reinterpret_cast<TTweenData<TPropType> *>(&tweens_data[offset_to_data]);
 
@@ -385,23 +691,32 @@ public:
         for (auto d : selection.data) {
           tc->user_data_idx = d;
           tc->prop_id = prop_id;
-          tc->start_delay = now + base_params[idx].delay;
+          tc->start_delay = now + base_params[idx].start_offset + base_params[idx].delay;
           tc->duration = base_params[idx].duration;
           tc->ease_fn = ease_fn;
           tc->remove_on_end = default_remove_on_end;
           tc->completed = false;
           tc->offset_to_data = (TIndex)offset_to_data;
-          tc->tween_fn = &setTweenedData<TPropType>;
+          tc->tween_fn = &CDataVisualizer::template setTweenedData<TPropType>;
+          tc->capture_fn = nullptr;
+          if (chained)
+            tc->capture_fn = &CDataVisualizer::template captureTweenedData<TPropType>;
           ++tc;
-          ++idx;
 
           assert((uint8_t*)addr < &tweens_data.back());
-          addr->value_t0 = selection.dv->getPropValue<TPropType>(d, prop_id);
+          if (!chained)
+            addr->value_t0 = selection.dv->getPropValue<TPropType>(d, prop_id);
           addr->value_t1 = prop_value_provider(selection.dv->all_user_data[ d ], idx);
+          if (!chained)
+            addr->prepare();
           addr++;
+          ++idx;
           offset_to_data += data_bytes_per_tween;
         }
-        assert((uint8_t*)addr - &tweens_data[0] == tweens_data.size());
+        assert((size_t)((uint8_t*)addr - &tweens_data[0]) == tweens_data.size());
+
+        if (selection.dv->recorder)
+          record<TPropType>(prop_id, i0);
 
         if (first_tween_idx == invalid_idx)
           first_tween_idx = i0;
@@ -409,6 +724,15 @@ public:
         return *this;
       }
 
+      // -----------------------------------------------------------
+      // Transition prop_id to scale( accessor(d) ). The scale is evaluated
+      // for the whole selection at once
+      template< typename TScale, typename TFn >
+      CTransition& setScaled(uint32_t prop_id, const TScale& scale, TFn accessor) {
+        auto values = selection.evalScale(scale, accessor);
+        return set(prop_id, [&values](const TUserData&, TIndex idx) { return values[idx]; });
+      }
+
       //// -----------------------------------------------------------
       template< typename TPropType >
       CTransition& setCte(uint32_t prop_id, TPropType cte_value) {
@@ -416,6 +740,18 @@ public:
         auto f = [cte_value](auto d, auto idx) { return cte_value; };
         return set(prop_id, f);
       }
+
+      // -----------------------------------------------------------
+      // Returns a new transition on the same selection, starting for each
+      // element when it ends in this transition. Duration and ease are
+      // inherited, delay is relative to the end of this transition.
+      // All the tweens of the chain are registered when calling set, and
+      // the initial values are read when each tween starts, after all the
+      // other tweens of that frame have been applied. So the stages can be
+      // set in any order
+      CTransition transition() const {
+        return CTransition(*this, TChainTag());
+      }
     };
 
     CTransition transition() const {
@@ -433,61 +769,46 @@ public:
     // Data:[   2 3 4 ] ->   Enter:[       4 ]   Updated:[ 2 3 ]  Exit:[ 1       ]  All:[ 1 2 3 4 ]
     // Data:[ 1 2     ] ->   Enter:[ 1       ]   Updated:[ 2   ]  Exit:[     3 4 ]  All:[ 1 2 3 4 ]
 
+    // Binds requested with dataAsync are applied first, in order, blocking
+    // until they finish and calling their on_applied
+    waitPendingJoin();
+
     // confirm new set is ordered
     std::sort(new_data.begin(), new_data.end());
 
-    // By default all exit 
-    s_exit = s_enter.merge( s_updated ).sort();
-    s_enter.data.clear();
-    s_updated.data.clear();
-
-    for (auto& nd : new_data) {
+    if (recorder)
+      recorder->recordData(new_data);
 
-      // Find user_data_idx for nd;
-      auto nd_iter = std::find(all_user_data.begin(), all_user_data.end(), nd);
-      TIndex data_idx = invalid_idx;
-
-      // If it does not exists in old_entries... it means it's really new, never seen before
-      if (nd_iter == all_user_data.end()) {
-
-        // Register the new user data
-        data_idx = (TIndex)all_user_data.size();
-        all_user_data.push_back(nd);
-        all_visual_data.resize(all_visual_data.size() + 1);
-
-        // The new entry is entering the data_set
-        s_enter.data.push_back(data_idx);
-      }
-      else {
-        // We have seen this entry before. Find where
-        data_idx = (TIndex)std::distance(all_user_data.begin(), nd_iter);
-
-        // Update our copy with the updated data
-        *nd_iter = nd;
-
-        // Now in terms if is new or no
-        auto it = std::find(s_exit.data.begin(), s_exit.data.end(), data_idx);
-        if (it == s_exit.data.end()) {
-          s_enter.data.push_back(data_idx);
-        }
-        else {
-          s_updated.data.push_back(data_idx);
-          s_exit.data.erase(it);
-        }
-      }
+    TJoinResult join = computeJoin(new_data);
+    applyJoin(join);
+    return s_updated;
+  }
 
+  // -----------------------------------------------------------------------------
+  // Same as data, but the join is computed in a background thread. The selections
+  // are not modified until the join is applied in the next update() after the join
+  // has finished. Then on_applied( updated() ) is called from the update thread.
+  // If another bind is requested while one is running, only the most recent one
+  // is kept and started when the running one is applied.
+  // A call to data() waits for the running and the queued binds, and applies them
+  // (calling their on_applied) before its own bind.
+  template< typename TFn >
+  void dataAsync(TUserDataContainer new_data, TFn on_applied) {
+    if (pending_join.valid()) {
+      queued_data.swap(new_data);
+      queued_on_applied = on_applied;
+      has_queued_join = true;
+      return;
     }
+    startJoin(std::move(new_data), on_applied);
+  }
 
-    s_enter.sortDataByIndex();
-    s_updated.sortDataByIndex();
-
-    // At this point
-    //   exit contains the elems that were there but no longer are
-    //   enter contains the elems that were not there but now are
-    //   update contains the elems that were there and are
-    return s_updated;
+  void dataAsync(TUserDataContainer new_data) {
+    dataAsync(std::move(new_data), [](CSelection&) {});
   }
 
+  bool isJoinPending() const { return pending_join.valid(); }
+
   CSelection& exit() { return s_exit; }
   CSelection& enter() { return s_enter; }
   CSelection& updated() { return s_updated; }
@@ -509,6 +830,23 @@ public:
   }
 
   void update(float dt) {
+    // Frame boundary. Apply the background join if it's ready
+    if (pending_join.valid()
+      && pending_join.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+      applyPendingJoin();
+
+    // Scales changed since the last frame. Before recordUpdate, so the
+    // replay starts their transitions in the same frame
+    for (auto& b : scale_bindings) {
+      if (b.scale->getVersion() != b.version) {
+        b.version = b.scale->getVersion();
+        b.on_changed();
+      }
+    }
+
+    if (recorder)
+      recorder->recordUpdate(dt);
+
     current_time += dt;
     if (!updateTweens(dt))
       current_time = 0.f;
@@ -518,6 +856,70 @@ public:
 
   const std::vector< TTweenValue >& getTweens() const { return tweens; }
 
+  // -----------------------------------------------------------------------------
+  // Index the items by the tween::TVec2 value of prop_id, to find them by position.
+  // The bound items are indexed by their current value, and the index is
+  // updated on each write to prop_id, by set, append or the tweens
+  void spatialIndex(uint32_t prop_id) {
+    spatial_prop_id = prop_id;
+    spatial_index_fn = &CDataVisualizer::indexVisual;
+    spatial_index.clear();
+    for (auto d : s_enter.merge(s_updated).data)
+      indexVisual(d);
+  }
+
+  // Selection with the item closest to (x,y) within radius, or empty
+  CSelection find(float x, float y, float radius = FLT_MAX) {
+    CSelection sel;
+    sel.dv = this;
+    uint32_t idx = spatial_index.find(x, y, radius);
+    if (idx != quadtree::CQuadtree::invalid_idx)
+      sel.data.push_back(idx);
+    return sel;
+  }
+
+  // Selection with the items inside [x0,x1) x [y0,y1)
+  CSelection within(float x0, float y0, float x1, float y1) {
+    CSelection sel;
+    sel.dv = this;
+    spatial_index.within(x0, y0, x1, y1, sel.data);
+    sel.sortDataByIndex();
+    return sel;
+  }
+
+  // -----------------------------------------------------------------------------
+  // Sets prop_id to scale( accessor(d) ) for the bound items, and each time the
+  // domain or range of the scale changes, transitions them to the new values.
+  // The scale must outlive the binding
+  template< typename TScale, typename TFn >
+  void bindScale(uint32_t prop_id, const TScale& scale, TFn accessor, float duration = 0.25f) {
+    unbindScale(prop_id);
+    TScaleBinding binding;
+    binding.prop_id = prop_id;
+    binding.scale = &scale;
+    binding.version = scale.getVersion();
+    binding.on_changed = [this, prop_id, &scale, accessor, duration]() {
+      CSelection bound = s_enter.merge(s_updated);
+      if (!bound.empty())
+        bound.transition().duration(duration).setScaled(prop_id, scale, accessor);
+    };
+    s_enter.merge(s_updated).setScaled(prop_id, scale, accessor);
+    scale_bindings.push_back(binding);
+  }
+
+  void unbindScale(uint32_t prop_id) {
+    scale_bindings.erase(std::remove_if(scale_bindings.begin(), scale_bindings.end(), [prop_id](const TScaleBinding& b) {
+      return b.prop_id == prop_id;
+    }), scale_bindings.end());
+  }
+
+  // Calls to data, update, set and transition sets will be saved in the recorder.
+  // The recorder must have been opened with sizeof(TUserData). null to stop recording
+  void setRecorder(trace::CRecorder* new_recorder) {
+    assert(!new_recorder || new_recorder->isOpen());
+    recorder = new_recorder;
+  }
+
 private:
 
   CSelection                s_updated;
@@ -529,7 +931,38 @@ private:
 
   float                     current_time;
 
+  // Background join in progress, and the most recent bind requested meanwhile
+  std::future< TJoinResult > pending_join;
+  TOnJoinAppliedFn           pending_on_applied;
+  TUserDataContainer         queued_data;
+  TOnJoinAppliedFn           queued_on_applied;
+  bool                       has_queued_join = false;
+
+  trace::CRecorder*          recorder = nullptr;
+
+  uint32_t                   spatial_prop_id = ~0u;
+  quadtree::CQuadtree        spatial_index;
+  void (CDataVisualizer::*spatial_index_fn)(TIndex) = nullptr;
+
+  struct TScaleBinding {
+    uint32_t               prop_id;
+    const scale::CScale*   scale;
+    uint32_t               version;        // Of the scale when last applied
+    std::function< void() > on_changed;
+  };
+  std::vector< TScaleBinding > scale_bindings;
+
   friend class CSelection;
+  template< typename TVisualizer >
+  friend class trace::CReplayer;
+
+  // Used by the replayer to rebuild the recorded selections
+  CSelection makeSelection(TVisualizedDataContainer idxs) {
+    CSelection sel;
+    sel.dv = this;
+    sel.data.swap(idxs);
+    return sel;
+  }
 
 };
 
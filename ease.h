@@ -139,6 +139,14 @@ namespace ease {
     };
     return funcs[e_type];
   }
+  // Returns EASE_TYPES_COUNT if fn is not one of the builtin functions
+  uint32_t getType(TEaseFn fn) {
+    for (uint32_t e_type = 0; e_type < EASE_TYPES_COUNT; ++e_type) {
+      if (getFunc(e_type) == fn)
+        return e_type;
+    }
+    return EASE_TYPES_COUNT;
+  }
   const char* getName(uint32_t e_type) {
     assert(e_type < EASE_TYPES_COUNT);
     static const char* names[EASE_TYPES_COUNT] = {
@@ -0,0 +1,546 @@
+#ifndef INC_FORCE_H_
+#define INC_FORCE_H_
+
+#include <cstdint>
+#include <cassert>
+#include <cfloat>
+#include <vector>
+#include <math.h>
+#include "tween.h"
+#include "parallel.h"
+
+/*
+
+  Force directed layout, in the style of d3-force
+
+  Each tick the forces modify the velocities of the nodes, then the
+  velocities are damped and integrated. alpha cools down from 1 to
+  alpha_min, so the simulation stops after ~300 ticks by default.
+
+    many body : Barnes-Hut approximation over a quadtree. O(N log N)
+    link      : springs between pairs of nodes
+    center    : translates the nodes not fixed so their mean is the center
+    collide   : keeps nodes separated by their radius
+
+  many body and collide are evaluated in parallel, each thread writing only
+  the velocities of its own range of nodes.
+
+  The user data tells the index of its node:
+
+    sim.tick();
+    dv.enter().merge(dv.updated()).set(PROP_POS, sim.positions([](const TMyData& d) {
+      return d.node_idx;
+    }));
+
+*/
+
+namespace force {
+
+  struct TNode {
+    float x = 0.f, y = 0.f;
+    float vx = 0.f, vy = 0.f;
+    float radius = 0.f;           // Used by the collide force
+    bool  fixed = false;          // The simulation will not move it
+  };
+
+  struct TLink {
+    uint32_t source = 0;
+    uint32_t target = 0;
+    float    distance = 30.f;
+    float    strength = -1.f;     // < 0 to use 1 / min(degree(source), degree(target))
+  };
+
+  // -------------------------------------------------------
+  // Quadtree over a set of points, rebuilt each tick. Each quad stores the
+  // number of points, their center of mass and their max radius
+  class CQuadtree {
+  public:
+
+    static const uint32_t invalid_idx = ~0u;
+    static const uint32_t max_depth = 32;
+
+    struct TQuad {
+      uint32_t child[4];          // 0 if empty. The root is never a child
+      uint32_t first_point;       // Only in leafs, linked with next_point
+      uint32_t count;
+      float    cx, cy;            // Center of mass
+      float    r_max;             // Max radius of the points inside
+      bool isLeaf() const { return (child[0] | child[1] | child[2] | child[3]) == 0; }
+    };
+
+    std::vector< TQuad >    quads;
+    std::vector< uint32_t > next_point;
+    std::vector< float >    px, py, pr;
+    std::vector< uint32_t > order;            // Points in the order of the leafs. Nearby points are close
+    float                   x0 = 0.f, y0 = 0.f, size = 0.f;
+
+    void build() {
+      uint32_t n = (uint32_t)px.size();
+      quads.clear();
+      order.clear();
+      next_point.resize(n);
+      if (!n)
+        return;
+
+      // Square bounds of all the points
+      float xmin = FLT_MAX, ymin = FLT_MAX, xmax = -FLT_MAX, ymax = -FLT_MAX;
+      for (uint32_t i = 0; i < n; ++i) {
+        if (px[i] < xmin) xmin = px[i];
+        if (px[i] > xmax) xmax = px[i];
+        if (py[i] < ymin) ymin = py[i];
+        if (py[i] > ymax) ymax = py[i];
+      }
+      x0 = xmin;
+      y0 = ymin;
+      size = (xmax - xmin > ymax - ymin ? xmax - xmin : ymax - ymin) * 1.0001f + 1e-3f;
+
+      quads.reserve(2 * n);
+      quads.push_back(newLeaf());
+      for (uint32_t i = 0; i < n; ++i)
+        insert(i);
+      aggregate();
+
+      order.reserve(n);
+      visit([this](uint32_t q, float, float, float) {
+        for (uint32_t p = quads[q].first_point; p != invalid_idx; p = next_point[p])
+          order.push_back(p);
+        return false;
+      });
+    }
+
+    // fn(quad_idx, qx0, qy0, qsize) returns true to skip the children of the quad
+    template< typename TFn >
+    void visit(TFn fn) const {
+      if (quads.empty())
+        return;
+      struct TEntry { uint32_t q; float x0, y0, size; };
+      TEntry stack[max_depth * 4 + 4];
+      uint32_t nstack = 0;
+      stack[nstack++] = TEntry{ 0, x0, y0, size };
+      while (nstack) {
+        TEntry e = stack[--nstack];
+        if (fn(e.q, e.x0, e.y0, e.size))
+          continue;
+        const TQuad& quad = quads[e.q];
+        float half = e.size * 0.5f;
+        for (int c = 3; c >= 0; --c) {
+          if (quad.child[c])
+            stack[nstack++] = TEntry{ quad.child[c], e.x0 + (c & 1) * half, e.y0 + (c >> 1) * half, half };
+        }
+      }
+    }
+
+  private:
+
+    static TQuad newLeaf() {
+      TQuad q;
+      q.child[0] = q.child[1] = q.child[2] = q.child[3] = 0;
+      q.first_point = invalid_idx;
+      q.count = 0;
+      q.cx = q.cy = q.r_max = 0.f;
+      return q;
+    }
+
+    void insert(uint32_t i) {
+      uint32_t q = 0;
+      float qx0 = x0, qy0 = y0, qsize = size;
+      for (uint32_t depth = 0; ; ++depth) {
+        if (quads[q].isLeaf()) {
+          uint32_t p = quads[q].first_point;
+          if (p == invalid_idx) {
+            quads[q].first_point = i;
+            next_point[i] = invalid_idx;
+            return;
+          }
+          // Coincident points, or too deep, share the leaf
+          if (depth >= max_depth || (px[p] == px[i] && py[p] == py[i])) {
+            next_point[i] = p;
+            quads[q].first_point = i;
+            return;
+          }
+          // Split. All the points in the leaf are coincident, so move them to the same child
+          uint32_t c = childOf(p, qx0, qy0, qsize);
+          uint32_t new_q = (uint32_t)quads.size();
+          quads.push_back(newLeaf());
+          quads[new_q].first_point = p;
+          quads[q].first_point = invalid_idx;
+          quads[q].child[c] = new_q;
+        }
+
+        uint32_t c = childOf(i, qx0, qy0, qsize);
+        qsize *= 0.5f;
+        qx0 += (c & 1) * qsize;
+        qy0 += (c >> 1) * qsize;
+        if (!quads[q].child[c]) {
+          uint32_t new_q = (uint32_t)quads.size();
+          quads.push_back(newLeaf());
+          quads[new_q].first_point = i;
+          next_point[i] = invalid_idx;
+          quads[q].child[c] = new_q;
+          return;
+        }
+        q = quads[q].child[c];
+      }
+    }
+
+    uint32_t childOf(uint32_t i, float qx0, float qy0, float qsize) const {
+      float half = qsize * 0.5f;
+      return (px[i] >= qx0 + half ? 1 : 0) | (py[i] >= qy0 + half ? 2 : 0);
+    }
+
+    // Children are always created after their parents
+    void aggregate() {
+      for (size_t q = quads.size(); q--; ) {
+        TQuad& quad = quads[q];
+        float sx = 0.f, sy = 0.f, r_max = 0.f;
+        uint32_t count = 0;
+        if (quad.isLeaf()) {
+          for (uint32_t p = quad.first_point; p != invalid_idx; p = next_point[p]) {
+            sx += px[p];
+            sy += py[p];
+            if (pr[p] > r_max) r_max = pr[p];
+            ++count;
+          }
+        }
+        else {
+          for (int c = 0; c < 4; ++c) {
+            if (!quad.child[c])
+              continue;
+            const TQuad& child = quads[quad.child[c]];
+            sx += child.cx * child.count;
+            sy += child.cy * child.count;
+            if (child.r_max > r_max) r_max = child.r_max;
+            count += child.count;
+          }
+        }
+        quad.count = count;
+        quad.cx = count ? sx / count : 0.f;
+        quad.cy = count ? sy / count : 0.f;
+        quad.r_max = r_max;
+      }
+    }
+  };
+
+  // -------------------------------------------------------
+  class CSimulation {
+
+    std::vector< TNode >    nodes;
+    std::vector< TLink >    links;
+    std::vector< float >    link_bias;        // Per link, computed from the degree of the nodes
+    std::vector< float >    link_strength;
+    CQuadtree               tree;
+
+    float alpha = 1.f;
+    float alpha_min = 0.001f;
+    float alpha_decay = 1.f - powf(0.001f, 1.f / 300.f);
+    float alpha_target = 0.f;
+    float velocity_decay = 0.4f;
+
+    bool  many_body_enabled = true;
+    float many_body_strength = -30.f;
+    float many_body_theta2 = 0.81f;
+    float many_body_distance_min2 = 1.f;
+    float many_body_distance_max2 = FLT_MAX;
+
+    bool  center_enabled = false;
+    float center_x = 0.f, center_y = 0.f;
+
+    float collide_strength = 0.f;
+    uint32_t collide_iterations = 1;
+
+    uint32_t link_iterations = 1;
+
+    // Tiny deterministic displacement to separate coincident nodes
+    static float jiggle(uint32_t a, uint32_t b) {
+      uint32_t h = (a * 2654435761u) ^ (b * 40503u);
+      return ((h & 0xffff) / 65536.f - 0.5f) * 1e-6f;
+    }
+
+    void preparePoints(bool predicted) {
+      uint32_t n = (uint32_t)nodes.size();
+      tree.px.resize(n);
+      tree.py.resize(n);
+      tree.pr.resize(n);
+      for (uint32_t i = 0; i < n; ++i) {
+        const TNode& nd = nodes[i];
+        tree.px[i] = predicted ? nd.x + nd.vx : nd.x;
+        tree.py[i] = predicted ? nd.y + nd.vy : nd.y;
+        tree.pr[i] = nd.radius;
+      }
+      tree.build();
+    }
+
+    // ---------------------------------------------------------
+    void applyManyBody() {
+      preparePoints(false);
+      float k = many_body_strength * alpha;
+      parallel::forRange((uint32_t)nodes.size(), [this, k](uint32_t begin, uint32_t end, uint32_t) {
+        // Nearby nodes visit the same quads, so follow the tree order
+        for (uint32_t n = begin; n < end; ++n) {
+          uint32_t i = tree.order[n];
+          float xi = tree.px[i], yi = tree.py[i];
+          float vx = 0.f, vy = 0.f;
+          tree.visit([&](uint32_t q, float, float, float qsize) {
+            const CQuadtree::TQuad& quad = tree.quads[q];
+            if (!quad.count)
+              return true;
+            float dx = quad.cx - xi;
+            float dy = quad.cy - yi;
+            float l = dx * dx + dy * dy;
+
+            // Far enough, use the aggregate
+            if (qsize * qsize < l * many_body_theta2) {
+              if (l < many_body_distance_max2) {
+                if (l < many_body_distance_min2)
+                  l = sqrtf(many_body_distance_min2 * l);
+                float w = k * quad.count / l;
+                vx += dx * w;
+                vy += dy * w;
+              }
+              return true;
+            }
+
+            if (!quad.isLeaf())
+              return false;
+            if (l >= many_body_distance_max2)
+              return true;
+
+            for (uint32_t p = quad.first_point; p != CQuadtree::invalid_idx; p = tree.next_point[p]) {
+              if (p == i)
+                continue;
+              float px = tree.px[p] - xi;
+              float py = tree.py[p] - yi;
+              if (px == 0.f) px = jiggle(i, p);
+              if (py == 0.f) py = jiggle(p, i);
+              float lp = px * px + py * py;
+              if (lp < many_body_distance_min2)
+                lp = sqrtf(many_body_distance_min2 * lp);
+              vx += px * k / lp;
+              vy += py * k / lp;
+            }
+            return true;
+          });
+          nodes[i].vx += vx;
+          nodes[i].vy += vy;
+        }
+      });
+    }
+
+    // ---------------------------------------------------------
+    void applyLinks() {
+      for (uint32_t iter = 0; iter < link_iterations; ++iter) {
+        for (size_t li = 0; li < links.size(); ++li) {
+          const TLink& link = links[li];
+          TNode& s = nodes[link.source];
+          TNode& t = nodes[link.target];
+          float x = t.x + t.vx - s.x - s.vx;
+          float y = t.y + t.vy - s.y - s.vy;
+          if (x == 0.f) x = jiggle(link.source, link.target);
+          if (y == 0.f) y = jiggle(link.target, link.source);
+          float l = sqrtf(x * x + y * y);
+          l = (l - link.distance) / l * alpha * link_strength[li];
+          x *= l;
+          y *= l;
+          float b = link_bias[li];
+          t.vx -= x * b;
+          t.vy -= y * b;
+          s.vx += x * (1.f - b);
+          s.vy += y * (1.f - b);
+        }
+      }
+    }
+
+    // ---------------------------------------------------------
+    // Fixed nodes stay pinned, only the others are centered
+    void applyCenter() {
+      double sx = 0., sy = 0.;
+      uint32_t n = 0;
+      for (auto& nd : nodes) {
+        if (nd.fixed)
+          continue;
+        sx += nd.x;
+        sy += nd.y;
+        ++n;
+      }
+      if (!n)
+        return;
+      float dx = (float)(sx / n) - center_x;
+      float dy = (float)(sy / n) - center_y;
+      for (auto& nd : nodes) {
+        if (nd.fixed)
+          continue;
+        nd.x -= dx;
+        nd.y -= dy;
+      }
+    }
+
+    // ---------------------------------------------------------
+    // Each node only applies its own share of the push, so both nodes of a
+    // pair get the same result as the sequential version
+    void applyCollide() {
+      for (uint32_t iter = 0; iter < collide_iterations; ++iter) {
+        preparePoints(true);
+        parallel::forRange((uint32_t)nodes.size(), [this](uint32_t begin, uint32_t end, uint32_t) {
+          for (uint32_t n = begin; n < end; ++n) {
+            uint32_t i = tree.order[n];
+            // Nodes of radius 0 are pushed out of the others too
+            float ri = tree.pr[i];
+            float ri2 = ri * ri;
+            float xi = tree.px[i], yi = tree.py[i];
+            float vx = 0.f, vy = 0.f;
+            tree.visit([&](uint32_t q, float qx0, float qy0, float qsize) {
+              const CQuadtree::TQuad& quad = tree.quads[q];
+              float r = ri + quad.r_max;
+              if (!quad.count || qx0 > xi + r || qx0 + qsize < xi - r || qy0 > yi + r || qy0 + qsize < yi - r)
+                return true;
+              if (!quad.isLeaf())
+                return false;
+              for (uint32_t p = quad.first_point; p != CQuadtree::invalid_idx; p = tree.next_point[p]) {
+                if (p == i)
+                  continue;
+                float rj = tree.pr[p];
+                float rr = ri + rj;
+                float x = xi - tree.px[p];
+                float y = yi - tree.py[p];
+                float l = x * x + y * y;
+                if (l >= rr * rr)
+                  continue;
+                if (x == 0.f) x = jiggle(i, p);
+                if (y == 0.f) y = jiggle(p, i);
+                l = sqrtf(x * x + y * y);
+                l = (rr - l) / l * collide_strength;
+                float share = (rj * rj) / (ri2 + rj * rj);
+                vx += x * l * share;
+                vy += y * l * share;
+              }
+              return true;
+            });
+            nodes[i].vx += vx;
+            nodes[i].vy += vy;
+          }
+        });
+      }
+    }
+
+  public:
+
+    // ---------------------------------------------------------
+    // New nodes are placed in a phyllotaxis arrangement, as d3 does
+    void resize(uint32_t n) {
+      uint32_t old_n = (uint32_t)nodes.size();
+      nodes.resize(n);
+      const float initial_angle = 3.14159265f * (3.f - sqrtf(5.f));
+      for (uint32_t i = old_n; i < n; ++i) {
+        float radius = 10.f * sqrtf(0.5f + i);
+        float angle = i * initial_angle;
+        nodes[i].x = radius * cosf(angle);
+        nodes[i].y = radius * sinf(angle);
+      }
+    }
+
+    std::vector< TNode >& getNodes() { return nodes; }
+    const std::vector< TNode >& getNodes() const { return nodes; }
+
+    CSimulation& setLinks(const std::vector< TLink >& new_links) {
+      links = new_links;
+      std::vector< uint32_t > degree(nodes.size(), 0);
+      for (auto& link : links) {
+        assert(link.source < nodes.size() && link.target < nodes.size());
+        ++degree[link.source];
+        ++degree[link.target];
+      }
+      link_bias.resize(links.size());
+      link_strength.resize(links.size());
+      for (size_t li = 0; li < links.size(); ++li) {
+        uint32_t ds = degree[links[li].source];
+        uint32_t dt = degree[links[li].target];
+        link_bias[li] = (float)ds / (ds + dt);
+        link_strength[li] = links[li].strength >= 0.f ? links[li].strength : 1.f / (ds < dt ? ds : dt);
+      }
+      return *this;
+    }
+
+    CSimulation& linkIterations(uint32_t new_iterations) {
+      link_iterations = new_iterations;
+      return *this;
+    }
+
+    // strength < 0 repels, > 0 attracts. 0 disables the force
+    CSimulation& manyBody(float strength, float theta = 0.9f, float distance_min = 1.f, float distance_max = FLT_MAX) {
+      many_body_enabled = strength != 0.f;
+      many_body_strength = strength;
+      many_body_theta2 = theta * theta;
+      many_body_distance_min2 = distance_min * distance_min;
+      many_body_distance_max2 = distance_max < sqrtf(FLT_MAX) ? distance_max * distance_max : FLT_MAX;
+      return *this;
+    }
+
+    CSimulation& center(float x, float y) {
+      center_enabled = true;
+      center_x = x;
+      center_y = y;
+      return *this;
+    }
+
+    // Uses the radius of each node. 0 disables the force
+    CSimulation& collide(float strength, uint32_t iterations = 1) {
+      collide_strength = strength;
+      collide_iterations = iterations;
+      return *this;
+    }
+
+    CSimulation& alphaValue(float new_alpha) { alpha = new_alpha; return *this; }
+    CSimulation& alphaMin(float new_alpha_min) { alpha_min = new_alpha_min; return *this; }
+    CSimulation& alphaDecay(float new_alpha_decay) { alpha_decay = new_alpha_decay; return *this; }
+    CSimulation& alphaTarget(float new_alpha_target) { alpha_target = new_alpha_target; return *this; }
+    CSimulation& velocityDecay(float new_velocity_decay) { velocity_decay = new_velocity_decay; return *this; }
+
+    float getAlpha() const { return alpha; }
+    bool isActive() const { return alpha >= alpha_min; }
+
+    // ---------------------------------------------------------
+    void tick() {
+      alpha += (alpha_target - alpha) * alpha_decay;
+
+      if (many_body_enabled)
+        applyManyBody();
+      if (!links.empty())
+        applyLinks();
+      if (collide_strength > 0.f)
+        applyCollide();
+
+      float damp = 1.f - velocity_decay;
+      parallel::forRange((uint32_t)nodes.size(), [this, damp](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+          TNode& nd = nodes[i];
+          if (nd.fixed) {
+            nd.vx = nd.vy = 0.f;
+            continue;
+          }
+          nd.vx *= damp;
+          nd.vy *= damp;
+          nd.x += nd.vx;
+          nd.y += nd.vy;
+        }
+      }, 16 * 1024);
+
+      if (center_enabled)
+        applyCenter();
+    }
+
+    // ---------------------------------------------------------
+    // Provider for CSelection::set or CTransition::set, returning the position
+    // of the node node_index(d) for each user data d
+    template< typename TFn >
+    auto positions(TFn node_index) const {
+      return [this, node_index](const auto& d, uint32_t) {
+        uint32_t idx = (uint32_t)node_index(d);
+        assert(idx < nodes.size());
+        return tween::TVec2{ nodes[idx].x, nodes[idx].y };
+      };
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef INC_LOD_H_
+#define INC_LOD_H_
+
+#include <cstdint>
+#include <cassert>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+#include "simd.h"
+#include "parallel.h"
+
+/*
+
+  Level of detail for large series, sorted by x.
+
+  CPyramid keeps the min/max of y for buckets of 2^level consecutive
+  samples. Level 0 are the raw samples. Each level is built from the
+  previous one, so the whole pyramid is about twice the size of the series.
+
+  CView binds to a CDataVisualizer< lod::TMark, ... > the marks of the
+  finest level that gives no more than budget marks for the visible
+  x range, typically the width of the viewport in pixels.
+
+    lod::CPyramid pyramid;
+    pyramid.build(xs, ys, n);
+    lod::CView view;
+    ...
+    if (view.update(dv, pyramid, x_visible_min, x_visible_max, viewport_width)) {
+      dv.enter().transition()...
+      dv.exit().transition().remove();
+    }
+
+  The identity of a mark is its slot, key % slots, where slots is a bit more
+  than the number of marks that can be bound. Marks at the same level keep
+  their slot, so panning only enters and exits the marks at the sides.
+  Each level change switches between two disjoint ranges of slots, so all
+  the marks of the old level exit and the ones of the new level enter.
+  An id is reused two level changes later, so the exit transitions should
+  be shorter than the time between zooms.
+  The bound range is wider than the visible range, so panning and small
+  zooms don't rebind each frame. At most 2 * budget + 3 marks are bound.
+
+  So the visualizer never tracks more than 2 * slots items, and each rebind
+  costs about bound * 2 * slots comparisons in the join, O(budget^2).
+
+*/
+
+namespace lod {
+
+  // ---------------------------------------------------------
+  // count samples of level, starting at the sample key << level
+  struct TMark {
+    uint32_t level;
+    uint32_t key;           // Bucket index in the level
+    uint32_t slot;          // Identity of the mark in the visualizer
+    uint32_t count;
+    float    x0, x1;        // x of the first and last sample
+    float    y_min, y_max;
+    bool operator==(const TMark& other) const { return slot == other.slot; }
+    bool operator<(const TMark& other) const { return slot < other.slot; }
+  };
+
+  namespace internal {
+
+    // out[j] = min/max of in[2j], in[2j+1]. The last one alone when n is odd
+    inline void reducePairs(const float* in_min, const float* in_max, uint32_t n, float* out_min, float* out_max, uint32_t out_begin, uint32_t out_end) {
+      uint32_t j = out_begin;
+#if D3CPP_USE_SSE
+      for (; j + 4 <= out_end && 2 * j + 8 <= n; j += 4) {
+        __m128 a = _mm_loadu_ps(in_min + 2 * j);
+        __m128 b = _mm_loadu_ps(in_min + 2 * j + 4);
+        _mm_storeu_ps(out_min + j, _mm_min_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+        a = _mm_loadu_ps(in_max + 2 * j);
+        b = _mm_loadu_ps(in_max + 2 * j + 4);
+        _mm_storeu_ps(out_max + j, _mm_max_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+      }
+#endif
+      for (; j < out_end; ++j) {
+        uint32_t i = 2 * j;
+        if (i + 1 < n) {
+          out_min[j] = in_min[i] < in_min[i + 1] ? in_min[i] : in_min[i + 1];
+          out_max[j] = in_max[i] > in_max[i + 1] ? in_max[i] : in_max[i + 1];
+        }
+        else {
+          out_min[j] = in_min[i];
+          out_max[j] = in_max[i];
+        }
+      }
+    }
+  }
+
+  // ---------------------------------------------------------
+  class CPyramid {
+
+    struct TLevel {
+      std::vector< float > y_min;
+      std::vector< float > y_max;
+    };
+
+    std::vector< float >  xs;
+    std::vector< TLevel > levels;
+
+  public:
+
+    // x must be sorted
+    void build(const float* x, const float* y, uint32_t n) {
+      xs.assign(x, x + n);
+      levels.clear();
+      if (!n)
+        return;
+      levels.resize(1);
+      levels[0].y_min.assign(y, y + n);
+      levels[0].y_max.assign(y, y + n);
+      while (levels.back().y_min.size() > 1) {
+        uint32_t prev_size = (uint32_t)levels.back().y_min.size();
+        uint32_t size = (prev_size + 1) / 2;
+        TLevel level;
+        level.y_min.resize(size);
+        level.y_max.resize(size);
+        const TLevel& prev = levels.back();
+        parallel::forRange(size, [&](uint32_t begin, uint32_t end, uint32_t) {
+          internal::reducePairs(prev.y_min.data(), prev.y_max.data(), prev_size, level.y_min.data(), level.y_max.data(), begin, end);
+        }, 1 << 16);
+        levels.push_back(std::move(level));
+      }
+    }
+
+    uint32_t size() const { return (uint32_t)xs.size(); }
+    uint32_t numLevels() const { return (uint32_t)levels.size(); }
+    uint32_t levelSize(uint32_t level) const { return (uint32_t)levels[level].y_min.size(); }
+
+    // Samples with x in [x0,x1] are in [*first, *last)
+    void sampleRange(float x0, float x1, uint32_t* first, uint32_t* last) const {
+      *first = (uint32_t)(std::lower_bound(xs.begin(), xs.end(), x0) - xs.begin());
+      *last = (uint32_t)(std::upper_bound(xs.begin(), xs.end(), x1) - xs.begin());
+    }
+
+    // Finest level with at most budget buckets for nsamples
+    uint32_t levelFor(uint32_t nsamples, uint32_t budget) const {
+      assert(budget > 0);
+      uint32_t level = 0;
+      while (level + 1 < numLevels() && ((uint64_t)nsamples + (1ull << level) - 1) >> level > budget)
+        ++level;
+      return level;
+    }
+
+    TMark mark(uint32_t level, uint32_t key) const {
+      const TLevel& l = levels[level];
+      uint32_t first = key << level;
+      uint32_t last = std::min((uint32_t)xs.size(), (key + 1) << level) - 1;
+      TMark m;
+      m.level = level;
+      m.key = key;
+      m.slot = key;
+      m.count = last - first + 1;
+      m.x0 = xs[first];
+      m.x1 = xs[last];
+      m.y_min = l.y_min[key];
+      m.y_max = l.y_max[key];
+      return m;
+    }
+
+    // The buckets [key0, key1) of level
+    void marks(uint32_t level, uint32_t key0, uint32_t key1, std::vector< TMark >& out) const {
+      out.clear();
+      out.reserve(key1 - key0);
+      for (uint32_t k = key0; k < key1; ++k)
+        out.push_back(mark(level, k));
+    }
+  };
+
+  // ---------------------------------------------------------
+  // Keeps the visualizer bound to the marks of the visible range
+  class CView {
+    uint32_t bound_level = ~0u;
+    uint32_t bound_key0 = 0;
+    uint32_t bound_key1 = 0;
+    uint32_t bound_slots = 0;
+    uint32_t bound_phase = 0;     // Which of the two ranges of slots is bound
+    std::vector< TMark > marks;
+
+  public:
+
+    uint32_t getLevel() const { return bound_level; }
+
+    // Forget the bound marks, so the next update rebinds
+    void invalidate() { bound_level = ~0u; }
+
+    // Returns true when the bound marks changed, after calling dv.data(), so
+    // the caller can start the enter/exit transitions
+    template< typename TVisualizer >
+    bool update(TVisualizer& dv, const CPyramid& pyramid, float x0, float x1, uint32_t budget) {
+      if (!pyramid.size())
+        return false;
+
+      uint32_t first, last;
+      pyramid.sampleRange(x0, x1, &first, &last);
+      if (last <= first) {
+        first = std::min(first, pyramid.size() - 1);
+        last = first + 1;
+      }
+      uint32_t nsamples = last - first;
+
+      // Keep the current level while it gives between budget/4 and budget marks
+      uint32_t level = pyramid.levelFor(nsamples, budget);
+      if (bound_level != ~0u && bound_level < pyramid.numLevels()) {
+        uint64_t nbound = ((uint64_t)nsamples + (1ull << bound_level) - 1) >> bound_level;
+        if (nbound <= budget && (nbound > budget / 4 || bound_level == 0))
+          level = bound_level;
+      }
+
+      uint32_t key0 = first >> level;
+      uint32_t key1 = ((last - 1) >> level) + 1;
+      if (level == bound_level && key0 >= bound_key0 && key1 <= bound_key1)
+        return false;
+
+      // A new level or budget gives new ids to all the marks
+      uint32_t slots = 2 * budget + 4;
+      if (level != bound_level || slots != bound_slots)
+        bound_phase ^= 1;
+
+      // Bind half the visible marks more at each side
+      uint32_t margin = (key1 - key0 + 1) / 2;
+      uint32_t nkeys = pyramid.levelSize(level);
+      bound_level = level;
+      bound_key0 = key0 > margin ? key0 - margin : 0;
+      bound_key1 = std::min(nkeys, key1 + margin);
+      bound_slots = slots;
+
+      // The bound keys are consecutive and fewer than slots, so their slots are unique
+      assert(bound_key1 - bound_key0 <= slots);
+      pyramid.marks(bound_level, bound_key0, bound_key1, marks);
+      for (auto& m : marks)
+        m.slot = bound_phase * slots + m.key % slots;
+      dv.data(marks);
+      return true;
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef INC_PARALLEL_H_
+#define INC_PARALLEL_H_
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+  inline uint32_t numThreads() {
+    static const uint32_t n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+  }
+
+  // Number of chunks forRange will use for n items. To preallocate per chunk data
+  inline uint32_t numChunks(uint32_t n, uint32_t min_items_per_chunk = 1024) {
+    uint32_t nchunks = numThreads();
+    if (nchunks > n / min_items_per_chunk)
+      nchunks = n / min_items_per_chunk;
+    return nchunks ? nchunks : 1;
+  }
+
+  // ---------------------------------------------------------
+  // Splits [0,n) in one chunk per core and calls fn(begin, end, chunk_idx) for
+  // each one in parallel. The calling thread runs the last chunk.
+  // Small ranges run entirely in the calling thread
+  template< typename TFn >
+  void forRange(uint32_t n, TFn fn, uint32_t min_items_per_chunk = 1024) {
+    uint32_t nchunks = numChunks(n, min_items_per_chunk);
+    if (nchunks <= 1) {
+      fn(0u, n, 0u);
+      return;
+    }
+
+    auto chunkBegin = [n, nchunks](uint32_t c) {
+      return (uint32_t)((uint64_t)n * c / nchunks);
+    };
+    std::vector< std::thread > workers;
+    workers.reserve(nchunks - 1);
+    for (uint32_t c = 0; c + 1 < nchunks; ++c) {
+      uint32_t begin = chunkBegin(c);
+      uint32_t end = chunkBegin(c + 1);
+      workers.emplace_back([&fn, begin, end, c]() { fn(begin, end, c); });
+    }
+    uint32_t last = nchunks - 1;
+    fn(chunkBegin(last), n, last);
+
+    for (auto& w : workers)
+      w.join();
+  }
+
+}
+
+#endif
@@ -0,0 +1,369 @@
+#ifndef INC_QUADTREE_H_
+#define INC_QUADTREE_H_
+
+#include <cstdint>
+#include <cassert>
+#include <cfloat>
+#include <vector>
+#include <math.h>
+
+namespace quadtree {
+
+  // ---------------------------------------------------------
+  // Incremental point quadtree, in the style of d3-quadtree. Items are
+  // identified by a user index, and can be inserted, moved and removed
+  // one by one. Moving an item inside its leaf is O(1), the rest is
+  // O(depth). The tree grows to cover points outside the bounds, and
+  // collapses subtrees when they become small
+  class CQuadtree {
+  public:
+    static const uint32_t invalid_idx = ~0u;
+
+  private:
+    static const uint32_t leaf_capacity = 8;
+    static const uint32_t max_depth = 24;
+    static const uint32_t max_stack = 4 * 64;       // Deep enough even after growing the root many times
+
+    struct TNode {
+      float    x0, y0, size;
+      uint32_t parent;
+      uint32_t child[4];          // invalid_idx if empty. All invalid in the leafs
+      uint32_t first_item;        // Only in leafs
+      uint32_t count;             // Items in the subtree
+      uint32_t depth;
+      bool isLeaf() const { return child[0] == invalid_idx && child[1] == invalid_idx && child[2] == invalid_idx && child[3] == invalid_idx; }
+      bool contains(float x, float y) const { return x >= x0 && x < x0 + size && y >= y0 && y < y0 + size; }
+    };
+
+    struct TItem {
+      float    x, y;
+      uint32_t leaf;              // invalid_idx when not in the tree
+      uint32_t prev, next;        // Items of the same leaf
+    };
+
+    std::vector< TNode >    nodes;
+    std::vector< uint32_t > free_nodes;
+    std::vector< TItem >    items;
+    uint32_t                root = invalid_idx;
+
+    // -------------------------------------------------------
+    uint32_t allocNode(float x0, float y0, float size, uint32_t parent, uint32_t depth) {
+      TNode n;
+      n.x0 = x0;
+      n.y0 = y0;
+      n.size = size;
+      n.parent = parent;
+      n.child[0] = n.child[1] = n.child[2] = n.child[3] = invalid_idx;
+      n.first_item = invalid_idx;
+      n.count = 0;
+      n.depth = depth;
+      if (!free_nodes.empty()) {
+        uint32_t idx = free_nodes.back();
+        free_nodes.pop_back();
+        nodes[idx] = n;
+        return idx;
+      }
+      nodes.push_back(n);
+      return (uint32_t)nodes.size() - 1;
+    }
+
+    uint32_t childIndexOf(const TNode& n, float x, float y) const {
+      float half = n.size * 0.5f;
+      return (x >= n.x0 + half ? 1 : 0) | (y >= n.y0 + half ? 2 : 0);
+    }
+
+    void linkItem(uint32_t leaf, uint32_t id) {
+      TItem& it = items[id];
+      it.leaf = leaf;
+      it.prev = invalid_idx;
+      it.next = nodes[leaf].first_item;
+      if (it.next != invalid_idx)
+        items[it.next].prev = id;
+      nodes[leaf].first_item = id;
+    }
+
+    void unlinkItem(uint32_t id) {
+      TItem& it = items[id];
+      if (it.prev != invalid_idx)
+        items[it.prev].next = it.next;
+      else
+        nodes[it.leaf].first_item = it.next;
+      if (it.next != invalid_idx)
+        items[it.next].prev = it.prev;
+      it.leaf = invalid_idx;
+    }
+
+    // Double the root until it contains (x,y)
+    void cover(float x, float y) {
+      if (root == invalid_idx) {
+        root = allocNode(x - 0.5f, y - 0.5f, 1.f, invalid_idx, 0);
+        return;
+      }
+      while (!nodes[root].contains(x, y)) {
+        const TNode r = nodes[root];
+        // Grow towards the point. The old root becomes the opposite child
+        uint32_t c = (x < r.x0 ? 1 : 0) | (y < r.y0 ? 2 : 0);
+        float nx0 = (c & 1) ? r.x0 - r.size : r.x0;
+        float ny0 = (c & 2) ? r.y0 - r.size : r.y0;
+        uint32_t new_root = allocNode(nx0, ny0, r.size * 2.f, invalid_idx, 0);
+        nodes[new_root].count = r.count;
+        if (r.count) {
+          nodes[new_root].child[c] = root;
+          nodes[root].parent = new_root;
+          incDepth(root);
+        }
+        else {
+          freeSubtree(root);
+        }
+        root = new_root;
+      }
+    }
+
+    void incDepth(uint32_t n) {
+      ++nodes[n].depth;
+      for (uint32_t c = 0; c < 4; ++c)
+        if (nodes[n].child[c] != invalid_idx)
+          incDepth(nodes[n].child[c]);
+    }
+
+    void freeSubtree(uint32_t n) {
+      for (uint32_t c = 0; c < 4; ++c)
+        if (nodes[n].child[c] != invalid_idx)
+          freeSubtree(nodes[n].child[c]);
+      free_nodes.push_back(n);
+    }
+
+    void insert(uint32_t id) {
+      const TItem& it = items[id];
+      cover(it.x, it.y);
+      uint32_t n = root;
+      while (true) {
+        ++nodes[n].count;
+        if (nodes[n].isLeaf())
+          break;
+        uint32_t c = childIndexOf(nodes[n], it.x, it.y);
+        if (nodes[n].child[c] == invalid_idx) {
+          const TNode& p = nodes[n];
+          float half = p.size * 0.5f;
+          uint32_t new_leaf = allocNode(p.x0 + (c & 1) * half, p.y0 + (c >> 1) * half, half, n, p.depth + 1);
+          nodes[n].child[c] = new_leaf;
+        }
+        n = nodes[n].child[c];
+      }
+      linkItem(n, id);
+      if (nodes[n].count > leaf_capacity && nodes[n].depth < max_depth)
+        split(n);
+    }
+
+    void split(uint32_t n) {
+      uint32_t id = nodes[n].first_item;
+      nodes[n].first_item = invalid_idx;
+      while (id != invalid_idx) {
+        uint32_t next = items[id].next;
+        uint32_t c = childIndexOf(nodes[n], items[id].x, items[id].y);
+        if (nodes[n].child[c] == invalid_idx) {
+          const TNode& p = nodes[n];
+          float half = p.size * 0.5f;
+          uint32_t new_leaf = allocNode(p.x0 + (c & 1) * half, p.y0 + (c >> 1) * half, half, n, p.depth + 1);
+          nodes[n].child[c] = new_leaf;
+        }
+        uint32_t leaf = nodes[n].child[c];
+        ++nodes[leaf].count;
+        linkItem(leaf, id);
+        id = next;
+      }
+      // All in the same child? keep splitting
+      for (uint32_t c = 0; c < 4; ++c) {
+        uint32_t ch = nodes[n].child[c];
+        if (ch != invalid_idx && nodes[ch].count > leaf_capacity && nodes[ch].depth < max_depth)
+          split(ch);
+      }
+    }
+
+    // Moves all the items of the subtree of n to the leaf 'dst'
+    void gatherItems(uint32_t n, uint32_t dst) {
+      if (nodes[n].isLeaf()) {
+        uint32_t id = nodes[n].first_item;
+        while (id != invalid_idx) {
+          uint32_t next = items[id].next;
+          linkItem(dst, id);
+          id = next;
+        }
+        return;
+      }
+      for (uint32_t c = 0; c < 4; ++c)
+        if (nodes[n].child[c] != invalid_idx)
+          gatherItems(nodes[n].child[c], dst);
+    }
+
+    void collapse(uint32_t n) {
+      uint32_t children[4];
+      for (uint32_t c = 0; c < 4; ++c) {
+        children[c] = nodes[n].child[c];
+        nodes[n].child[c] = invalid_idx;
+      }
+      nodes[n].first_item = invalid_idx;
+      for (uint32_t c = 0; c < 4; ++c) {
+        if (children[c] == invalid_idx)
+          continue;
+        gatherItems(children[c], n);
+        freeSubtree(children[c]);
+      }
+    }
+
+    void removeFromTree(uint32_t id) {
+      uint32_t leaf = items[id].leaf;
+      unlinkItem(id);
+
+      // Update the counts up to the root, remembering the highest node small enough to be a leaf
+      uint32_t to_collapse = invalid_idx;
+      for (uint32_t n = leaf; n != invalid_idx; n = nodes[n].parent) {
+        --nodes[n].count;
+        if (!nodes[n].isLeaf() && nodes[n].count <= leaf_capacity / 2)
+          to_collapse = n;
+      }
+      if (to_collapse != invalid_idx)
+        collapse(to_collapse);
+    }
+
+    static float boxDistance2(const TNode& n, float x, float y) {
+      float dx = x < n.x0 ? n.x0 - x : (x > n.x0 + n.size ? x - n.x0 - n.size : 0.f);
+      float dy = y < n.y0 ? n.y0 - y : (y > n.y0 + n.size ? y - n.y0 - n.size : 0.f);
+      return dx * dx + dy * dy;
+    }
+
+    template< typename TFn >
+    void eachItemOf(uint32_t n, TFn fn) const {
+      const TNode& node = nodes[n];
+      if (node.isLeaf()) {
+        for (uint32_t id = node.first_item; id != invalid_idx; id = items[id].next)
+          fn(id);
+        return;
+      }
+      for (uint32_t c = 0; c < 4; ++c)
+        if (node.child[c] != invalid_idx)
+          eachItemOf(node.child[c], fn);
+    }
+
+  public:
+
+    // -------------------------------------------------------
+    // Inserts or moves the item id. Items with a non finite coordinate are
+    // removed, as the root can't grow to cover them
+    void update(uint32_t id, float x, float y) {
+      if (!(fabsf(x) <= FLT_MAX && fabsf(y) <= FLT_MAX)) {
+        remove(id);
+        return;
+      }
+      if (id >= items.size()) {
+        TItem empty = { 0.f, 0.f, invalid_idx, invalid_idx, invalid_idx };
+        items.resize(id + 1, empty);
+      }
+      TItem& it = items[id];
+      if (it.leaf != invalid_idx) {
+        it.x = x;
+        it.y = y;
+        if (nodes[it.leaf].contains(x, y))
+          return;
+        removeFromTree(id);
+      }
+      else {
+        it.x = x;
+        it.y = y;
+      }
+      insert(id);
+    }
+
+    void remove(uint32_t id) {
+      if (contains(id))
+        removeFromTree(id);
+    }
+
+    bool contains(uint32_t id) const {
+      return id < items.size() && items[id].leaf != invalid_idx;
+    }
+
+    uint32_t size() const { return root == invalid_idx ? 0 : nodes[root].count; }
+
+    void clear() {
+      nodes.clear();
+      free_nodes.clear();
+      items.clear();
+      root = invalid_idx;
+    }
+
+    // -------------------------------------------------------
+    // Appends to out the ids of the items inside [x0,x1) x [y0,y1)
+    void within(float x0, float y0, float x1, float y1, std::vector< uint32_t >& out) const {
+      if (root == invalid_idx)
+        return;
+      uint32_t stack[max_stack];
+      uint32_t nstack = 0;
+      stack[nstack++] = root;
+      while (nstack) {
+        uint32_t ni = stack[--nstack];
+        const TNode& n = nodes[ni];
+        if (!n.count || n.x0 >= x1 || n.y0 >= y1 || n.x0 + n.size < x0 || n.y0 + n.size < y0)
+          continue;
+        // Fully inside, no need to test each item
+        if (n.x0 >= x0 && n.y0 >= y0 && n.x0 + n.size <= x1 && n.y0 + n.size <= y1) {
+          eachItemOf(ni, [&out](uint32_t id) { out.push_back(id); });
+          continue;
+        }
+        if (n.isLeaf()) {
+          for (uint32_t id = n.first_item; id != invalid_idx; id = items[id].next) {
+            const TItem& it = items[id];
+            if (it.x >= x0 && it.x < x1 && it.y >= y0 && it.y < y1)
+              out.push_back(id);
+          }
+          continue;
+        }
+        assert(nstack + 4 <= max_stack);
+        for (uint32_t c = 0; c < 4; ++c)
+          if (n.child[c] != invalid_idx)
+            stack[nstack++] = n.child[c];
+      }
+    }
+
+    // -------------------------------------------------------
+    // Returns the id of the item closest to (x,y) within radius, or invalid_idx
+    uint32_t find(float x, float y, float radius = FLT_MAX) const {
+      if (root == invalid_idx)
+        return invalid_idx;
+      uint32_t best = invalid_idx;
+      float    best_d2 = radius < sqrtf(FLT_MAX) ? radius * radius : FLT_MAX;
+      uint32_t stack[max_stack];
+      uint32_t nstack = 0;
+      stack[nstack++] = root;
+      while (nstack) {
+        const TNode& n = nodes[stack[--nstack]];
+        if (!n.count || boxDistance2(n, x, y) > best_d2)
+          continue;
+        if (n.isLeaf()) {
+          for (uint32_t id = n.first_item; id != invalid_idx; id = items[id].next) {
+            float dx = items[id].x - x;
+            float dy = items[id].y - y;
+            float d2 = dx * dx + dy * dy;
+            if (d2 <= best_d2) {
+              best_d2 = d2;
+              best = id;
+            }
+          }
+          continue;
+        }
+        // Visit first the child containing the point, so the radius shrinks fast
+        uint32_t first = childIndexOf(n, x, y);
+        assert(nstack + 4 <= max_stack);
+        for (uint32_t c = 0; c < 4; ++c) {
+          uint32_t ch = n.child[c ^ first ^ 3];
+          if (ch != invalid_idx)
+            stack[nstack++] = ch;
+        }
+      }
+      return best;
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef INC_SCALE_H_
+#define INC_SCALE_H_
+
+#include <cstdint>
+#include <cassert>
+#include <vector>
+#include <unordered_map>
+#include <math.h>
+#include "simd.h"
+
+/*
+
+  Scales in the style of d3-scale. Each one maps a single value with
+  operator(), and a whole array at once with apply, which is what
+  CSelection::setScaled and CTransition::setScaled use.
+
+    CLinear  : y = r0 + (x - d0) * (r1 - r0) / (d1 - d0)
+    CPow     : linear over sign(x) * |x|^exponent
+    CLog     : linear over log(x). The domain can't include 0
+    CTime    : linear over double timestamps, to keep the precision
+    CBand    : discrete bands for the indices 0..n-1
+    COrdinal : explicit mapping of keys to values
+
+  Every change to the domain or the range increments the version, so the
+  visualizer can transition the items bound to the scale.
+
+*/
+
+namespace scale {
+
+  class CScale {
+  protected:
+    uint32_t version = 0;
+    void changed() { ++version; }
+  public:
+    uint32_t getVersion() const { return version; }
+  };
+
+  namespace internal {
+
+    // out[i] = in[i] * k + b, optionally clamped to [lo,hi]
+    inline void linear(const float* in, float* out, uint32_t n, float k, float b, bool clamp, float lo, float hi) {
+      uint32_t i = 0;
+#if D3CPP_USE_SSE
+      __m128 vk = _mm_set1_ps(k);
+      __m128 vb = _mm_set1_ps(b);
+      __m128 vlo = _mm_set1_ps(lo);
+      __m128 vhi = _mm_set1_ps(hi);
+      if (clamp) {
+        for (; i + 4 <= n; i += 4)
+          _mm_storeu_ps(out + i, _mm_min_ps(vhi, _mm_max_ps(vlo, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), vk), vb))));
+      }
+      else {
+        for (; i + 4 <= n; i += 4)
+          _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), vk), vb));
+      }
+#endif
+      for (; i < n; ++i) {
+        float v = in[i] * k + b;
+        if (clamp)
+          v = v < lo ? lo : (v > hi ? hi : v);
+        out[i] = v;
+      }
+    }
+  }
+
+  // ---------------------------------------------------------
+  // Base of the scales which are a linear map after transforming the input
+  template< typename TScale >
+  class CContinuous : public CScale {
+  protected:
+    float d0 = 0.f, d1 = 1.f;
+    float r0 = 0.f, r1 = 1.f;
+    bool  clamped = false;
+
+    // Cached linear map over the transformed domain
+    float k = 1.f, b = 0.f;
+
+    void update() {
+      float t0 = TScale::transform(d0, self());
+      float t1 = TScale::transform(d1, self());
+      k = (t1 != t0) ? (r1 - r0) / (t1 - t0) : 0.f;
+      b = r0 - t0 * k;
+      changed();
+    }
+
+    const TScale& self() const { return *static_cast<const TScale*>(this); }
+
+  public:
+    typedef float TInput;
+
+    TScale& domain(float new_d0, float new_d1) {
+      d0 = new_d0;
+      d1 = new_d1;
+      update();
+      return *static_cast<TScale*>(this);
+    }
+
+    TScale& range(float new_r0, float new_r1) {
+      r0 = new_r0;
+      r1 = new_r1;
+      update();
+      return *static_cast<TScale*>(this);
+    }
+
+    TScale& clamp(bool new_clamped) {
+      clamped = new_clamped;
+      changed();
+      return *static_cast<TScale*>(this);
+    }
+
+    float operator()(float x) const {
+      float v = TScale::transform(x, self()) * k + b;
+      if (clamped) {
+        float lo = r0 < r1 ? r0 : r1;
+        float hi = r0 < r1 ? r1 : r0;
+        v = v < lo ? lo : (v > hi ? hi : v);
+      }
+      return v;
+    }
+
+    // out can be the same as in
+    void apply(const float* in, float* out, uint32_t n) const {
+      const float* src = in;
+      if (!TScale::is_identity) {
+        for (uint32_t i = 0; i < n; ++i)
+          out[i] = TScale::transform(in[i], self());
+        src = out;
+      }
+      internal::linear(src, out, n, k, b, clamped, r0 < r1 ? r0 : r1, r0 < r1 ? r1 : r0);
+    }
+  };
+
+  // ---------------------------------------------------------
+  class CLinear : public CContinuous< CLinear > {
+  public:
+    static const bool is_identity = true;
+    static float transform(float x, const CLinear&) { return x; }
+  };
+
+  // ---------------------------------------------------------
+  class CPow : public CContinuous< CPow > {
+    float exponent_value = 1.f;
+  public:
+    static const bool is_identity = false;
+    static float transform(float x, const CPow& s) {
+      return x < 0.f ? -powf(-x, s.exponent_value) : powf(x, s.exponent_value);
+    }
+    CPow& exponent(float new_exponent) {
+      exponent_value = new_exponent;
+      update();
+      return *this;
+    }
+  };
+
+  // ---------------------------------------------------------
+  // Negative domains use -log(-x)
+  class CLog : public CContinuous< CLog > {
+    bool negative = false;
+  public:
+    static const bool is_identity = false;
+    static float transform(float x, const CLog& s) {
+      return s.negative ? -logf(-x) : logf(x);
+    }
+    CLog() {
+      domain(1.f, 10.f);
+    }
+    CLog& domain(float new_d0, float new_d1) {
+      assert(new_d0 * new_d1 > 0.f);
+      negative = new_d0 < 0.f;
+      CContinuous< CLog >::domain(new_d0, new_d1);
+      return *this;
+    }
+  };
+
+  // ---------------------------------------------------------
+  // Timestamps in seconds. The offset to d0 is computed in double precision
+  class CTime : public CScale {
+    double d0 = 0., d1 = 1.;
+    float  r0 = 0.f, r1 = 1.f;
+    double k = 1.;
+    void update() {
+      k = (d1 != d0) ? (r1 - r0) / (d1 - d0) : 0.;
+      changed();
+    }
+  public:
+    typedef double TInput;
+
+    CTime& domain(double new_d0, double new_d1) {
+      d0 = new_d0;
+      d1 = new_d1;
+      update();
+      return *this;
+    }
+    CTime& range(float new_r0, float new_r1) {
+      r0 = new_r0;
+      r1 = new_r1;
+      update();
+      return *this;
+    }
+    float operator()(double t) const {
+      return r0 + (float)((t - d0) * k);
+    }
+    void apply(const double* in, float* out, uint32_t n) const {
+      for (uint32_t i = 0; i < n; ++i)
+        out[i] = r0 + (float)((in[i] - d0) * k);
+    }
+  };
+
+  // ---------------------------------------------------------
+  // n bands of the same width covering the range. The input is the index of the band
+  class CBand : public CScale {
+    uint32_t count = 0;
+    float    r0 = 0.f, r1 = 1.f;
+    float    padding_inner = 0.f;
+    float    padding_outer = 0.f;
+    float    align_ratio = 0.5f;
+    float    step = 0.f;
+    float    start = 0.f;
+    float    band_width = 0.f;
+
+    void update() {
+      float n = (float)count;
+      float lo = r0 < r1 ? r0 : r1;
+      float hi = r0 < r1 ? r1 : r0;
+      float steps = n - padding_inner + padding_outer * 2.f;
+      step = (hi - lo) / (steps > 1.f ? steps : 1.f);
+      start = lo + (hi - lo - step * (n - padding_inner)) * align_ratio;
+      band_width = step * (1.f - padding_inner);
+      // Reversed range, the first band is at the end
+      if (r1 < r0) {
+        start = start + step * (n - 1.f);
+        step = -step;
+      }
+      changed();
+    }
+
+  public:
+    typedef float TInput;
+
+    CBand& domain(uint32_t new_count) { count = new_count; update(); return *this; }
+    CBand& range(float new_r0, float new_r1) { r0 = new_r0; r1 = new_r1; update(); return *this; }
+    CBand& paddingInner(float p) { padding_inner = p; update(); return *this; }
+    CBand& paddingOuter(float p) { padding_outer = p; update(); return *this; }
+    CBand& padding(float p) { padding_inner = padding_outer = p; update(); return *this; }
+    CBand& align(float a) { align_ratio = a; update(); return *this; }
+
+    float bandwidth() const { return band_width; }
+
+    // Start of the band idx
+    float operator()(float idx) const {
+      return start + step * idx;
+    }
+    void apply(const float* in, float* out, uint32_t n) const {
+      internal::linear(in, out, n, step, start, false, 0.f, 0.f);
+    }
+  };
+
+  // ---------------------------------------------------------
+  // Keys not found in the domain are added to it, in the order they are
+  // requested, and get the next value of the range, cycling
+  template< typename TKey, typename TValue >
+  class COrdinal : public CScale {
+    mutable std::unordered_map< TKey, uint32_t > index;
+    mutable uint32_t                             nkeys = 0;
+    std::vector< TValue >                        values;
+  public:
+    typedef TKey TInput;
+
+    COrdinal& domain(const std::vector< TKey >& keys) {
+      index.clear();
+      nkeys = 0;
+      for (auto& k : keys)
+        if (index.emplace(k, nkeys).second)
+          ++nkeys;
+      changed();
+      return *this;
+    }
+    COrdinal& range(const std::vector< TValue >& new_values) {
+      values = new_values;
+      changed();
+      return *this;
+    }
+    TValue operator()(const TKey& key) const {
+      assert(!values.empty());
+      auto it = index.find(key);
+      uint32_t idx = (it == index.end()) ? (index[key] = nkeys++) : it->second;
+      return values[idx % values.size()];
+    }
+    template< typename TOut >
+    void apply(const TKey* in, TOut* out, uint32_t n) const {
+      for (uint32_t i = 0; i < n; ++i)
+        out[i] = (*this)(in[i]);
+    }
+  };
+
+}
+
+#endif
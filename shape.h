@@ -0,0 +1,513 @@
+#ifndef INC_SHAPE_H_
+#define INC_SHAPE_H_
+
+#include <cstdint>
+#include <cassert>
+#include <vector>
+#include <math.h>
+#include "simd.h"
+#include "parallel.h"
+#include "tween.h"
+
+/*
+
+  Generators of triangle strips, in the style of d3-shape.
+
+    CLine : a polyline of the given width along the curve
+    CArea : the region between the curve and a horizontal baseline
+    CArc  : annular sectors, for pie and donut charts
+
+  The input are the positions of the items, usually the current (tweened)
+  values of a prop of a selection:
+
+    std::vector< tween::TVec2 > pts;
+    dv.updated().sort(byX).values(prop_pos, pts);
+    line.update(pts.data(), (uint32_t)pts.size());
+    upload(line.vertices(), line.dirtyRanges());
+
+  Each span between two consecutive points is tessellated with the same
+  number of curve points, so the vertices of a span are always at the same
+  offset. Only the spans affected by the points which have changed since
+  the previous update are generated again, and dirtyRanges() tells which
+  vertices have been rewritten.
+
+*/
+
+namespace shape {
+
+  typedef tween::TVec2 TVertex;
+
+  enum eCurve {
+    CURVE_LINEAR,
+    CURVE_MONOTONE_X,       // Monotone in y, for x sorted series. Fritsch-Carlson tangents
+    CURVE_CATMULL_ROM,      // Uniform catmull-rom, passes through all the points
+  };
+
+  // Vertices rewritten by the last update
+  struct TRange {
+    uint32_t first;
+    uint32_t count;
+  };
+
+  namespace internal {
+
+    // Cubic hermite basis at t = k / nsteps, for k = 0..nsteps-1
+    struct TBasis {
+      std::vector< float > h00, h10, h01, h11;
+      void resize(uint32_t nsteps) {
+        h00.resize(nsteps);
+        h10.resize(nsteps);
+        h01.resize(nsteps);
+        h11.resize(nsteps);
+        for (uint32_t k = 0; k < nsteps; ++k) {
+          float t = (float)k / (float)nsteps;
+          float t2 = t * t;
+          float t3 = t2 * t;
+          h00[k] = 2.f * t3 - 3.f * t2 + 1.f;
+          h10[k] = t3 - 2.f * t2 + t;
+          h01[k] = -2.f * t3 + 3.f * t2;
+          h11[k] = t3 - t2;
+        }
+      }
+    };
+
+    // out[k] = p0 * h00[k] + m0 * h10[k] + p1 * h01[k] + m1 * h11[k]
+    inline void hermite(const TBasis& b, uint32_t nsteps, float p0, float m0, float p1, float m1, float* out) {
+      uint32_t k = 0;
+#if D3CPP_USE_SSE
+      __m128 vp0 = _mm_set1_ps(p0);
+      __m128 vm0 = _mm_set1_ps(m0);
+      __m128 vp1 = _mm_set1_ps(p1);
+      __m128 vm1 = _mm_set1_ps(m1);
+      for (; k + 4 <= nsteps; k += 4) {
+        __m128 v = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(vp0, _mm_loadu_ps(&b.h00[k])), _mm_mul_ps(vm0, _mm_loadu_ps(&b.h10[k])))
+          , _mm_add_ps(_mm_mul_ps(vp1, _mm_loadu_ps(&b.h01[k])), _mm_mul_ps(vm1, _mm_loadu_ps(&b.h11[k])))
+        );
+        _mm_storeu_ps(out + k, v);
+      }
+#endif
+      for (; k < nsteps; ++k)
+        out[k] = p0 * b.h00[k] + m0 * b.h10[k] + p1 * b.h01[k] + m1 * b.h11[k];
+    }
+
+    // Vertices 2j and 2j+1 are the point j of the curve moved +-half_width
+    // along the normal. The tangent is the central difference, so joins are
+    // not mitered
+    inline void extrude(const float* cx, const float* cy, uint32_t n, uint32_t begin, uint32_t end, float half_width, TVertex* out) {
+      auto extrudeOne = [&](uint32_t j) {
+        uint32_t j0 = j > 0 ? j - 1 : j;
+        uint32_t j1 = j + 1 < n ? j + 1 : j;
+        float tx = cx[j1] - cx[j0];
+        float ty = cy[j1] - cy[j0];
+        float len2 = tx * tx + ty * ty;
+        float s = len2 > 1e-12f ? half_width / sqrtf(len2) : 0.f;
+        float nx = -ty * s;
+        float ny = tx * s;
+        out[2 * j].x = cx[j] + nx;
+        out[2 * j].y = cy[j] + ny;
+        out[2 * j + 1].x = cx[j] - nx;
+        out[2 * j + 1].y = cy[j] - ny;
+      };
+      uint32_t j = begin;
+      // The end points use one sided differences
+      if (j == 0 && j < end)
+        extrudeOne(j++);
+#if D3CPP_USE_SSE
+      __m128 vhw = _mm_set1_ps(half_width);
+      __m128 vtiny = _mm_set1_ps(1e-12f);
+      for (; j + 4 <= end && j + 5 <= n; j += 4) {
+        __m128 tx = _mm_sub_ps(_mm_loadu_ps(cx + j + 1), _mm_loadu_ps(cx + j - 1));
+        __m128 ty = _mm_sub_ps(_mm_loadu_ps(cy + j + 1), _mm_loadu_ps(cy + j - 1));
+        __m128 len2 = _mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty));
+        __m128 s = _mm_and_ps(_mm_cmpgt_ps(len2, vtiny), _mm_div_ps(vhw, _mm_sqrt_ps(len2)));
+        __m128 nx = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), ty), s);
+        __m128 ny = _mm_mul_ps(tx, s);
+        __m128 px = _mm_loadu_ps(cx + j);
+        __m128 py = _mm_loadu_ps(cy + j);
+        __m128 lx = _mm_add_ps(px, nx);
+        __m128 ly = _mm_add_ps(py, ny);
+        __m128 rx = _mm_sub_ps(px, nx);
+        __m128 ry = _mm_sub_ps(py, ny);
+        // l0 r0 l1 r1 ...
+        __m128 l01 = _mm_unpacklo_ps(lx, ly);
+        __m128 r01 = _mm_unpacklo_ps(rx, ry);
+        __m128 l23 = _mm_unpackhi_ps(lx, ly);
+        __m128 r23 = _mm_unpackhi_ps(rx, ry);
+        float* dst = &out[2 * j].x;
+        _mm_storeu_ps(dst, _mm_movelh_ps(l01, r01));
+        _mm_storeu_ps(dst + 4, _mm_movehl_ps(r01, l01));
+        _mm_storeu_ps(dst + 8, _mm_movelh_ps(l23, r23));
+        _mm_storeu_ps(dst + 12, _mm_movehl_ps(r23, l23));
+      }
+#endif
+      for (; j < end; ++j)
+        extrudeOne(j);
+    }
+
+    // Vertices 2j and 2j+1 are the point j of the curve and its projection
+    // on the baseline
+    inline void fill(const float* cx, const float* cy, uint32_t begin, uint32_t end, float baseline, TVertex* out) {
+      uint32_t j = begin;
+#if D3CPP_USE_SSE
+      __m128 vb = _mm_set1_ps(baseline);
+      for (; j + 4 <= end; j += 4) {
+        __m128 px = _mm_loadu_ps(cx + j);
+        __m128 py = _mm_loadu_ps(cy + j);
+        __m128 t01 = _mm_unpacklo_ps(px, py);
+        __m128 b01 = _mm_unpacklo_ps(px, vb);
+        __m128 t23 = _mm_unpackhi_ps(px, py);
+        __m128 b23 = _mm_unpackhi_ps(px, vb);
+        float* dst = &out[2 * j].x;
+        _mm_storeu_ps(dst, _mm_movelh_ps(t01, b01));
+        _mm_storeu_ps(dst + 4, _mm_movehl_ps(b01, t01));
+        _mm_storeu_ps(dst + 8, _mm_movelh_ps(t23, b23));
+        _mm_storeu_ps(dst + 12, _mm_movehl_ps(b23, t23));
+      }
+#endif
+      for (; j < end; ++j) {
+        out[2 * j].x = cx[j];
+        out[2 * j].y = cy[j];
+        out[2 * j + 1].x = cx[j];
+        out[2 * j + 1].y = baseline;
+      }
+    }
+  }
+
+  // ---------------------------------------------------------
+  // Tessellation of the points, shared by CLine and CArea. Each curve point
+  // generates two vertices
+  class CCurve {
+  protected:
+    eCurve                 curve_type = CURVE_LINEAR;
+    uint32_t               nsteps = 1;           // Curve points per span
+    bool                   all_dirty = true;     // Settings changed, regenerate everything
+
+    std::vector< TVertex > points;               // As given in the last update
+    std::vector< uint8_t > point_changed;
+    std::vector< uint8_t > span_dirty;
+    std::vector< float >   cx, cy;               // The curve points
+    internal::TBasis       basis;
+
+    std::vector< TVertex > verts;
+    std::vector< TRange >  dirty_ranges;
+
+    uint32_t numCurvePoints() const {
+      uint32_t n = (uint32_t)points.size();
+      return n < 2 ? n : (n - 1) * nsteps + 1;
+    }
+
+    // Hermite tangents of the span i, from points[i] to points[i+1]
+    void spanTangents(uint32_t i, TVertex& m0, TVertex& m1) const {
+      const TVertex& p0 = points[i];
+      const TVertex& p1 = points[i + 1];
+      switch (curve_type) {
+      case CURVE_CATMULL_ROM:
+        m0 = tangentCatmullRom(i);
+        m1 = tangentCatmullRom(i + 1);
+        break;
+      case CURVE_MONOTONE_X: {
+        float dx = p1.x - p0.x;
+        m0.x = m1.x = dx;
+        m0.y = dx * slopeMonotone(i);
+        m1.y = dx * slopeMonotone(i + 1);
+        break; }
+      default:
+        m0.x = m1.x = p1.x - p0.x;
+        m0.y = m1.y = p1.y - p0.y;
+      }
+    }
+
+    TVertex tangentCatmullRom(uint32_t j) const {
+      uint32_t n = (uint32_t)points.size();
+      uint32_t j0 = j > 0 ? j - 1 : j;
+      uint32_t j1 = j + 1 < n ? j + 1 : j;
+      float s = (j0 != j && j1 != j) ? 0.5f : 1.f;
+      TVertex m;
+      m.x = (points[j1].x - points[j0].x) * s;
+      m.y = (points[j1].y - points[j0].y) * s;
+      return m;
+    }
+
+    // Same as d3 curveMonotoneX
+    static float sign(float x) { return x < 0.f ? -1.f : 1.f; }
+    float secant(uint32_t i) const {
+      float h = points[i + 1].x - points[i].x;
+      return h != 0.f ? (points[i + 1].y - points[i].y) / h : 0.f;
+    }
+    float slopeInterior(uint32_t j) const {
+      float h0 = points[j].x - points[j - 1].x;
+      float h1 = points[j + 1].x - points[j].x;
+      float s0 = secant(j - 1);
+      float s1 = secant(j);
+      float p = (h0 + h1) != 0.f ? (s0 * h1 + s1 * h0) / (h0 + h1) : 0.f;
+      float m = fabsf(s0) < fabsf(s1) ? fabsf(s0) : fabsf(s1);
+      if (0.5f * fabsf(p) < m)
+        m = 0.5f * fabsf(p);
+      return (sign(s0) + sign(s1)) * m;
+    }
+    float slopeMonotone(uint32_t j) const {
+      uint32_t n = (uint32_t)points.size();
+      if (n == 2)
+        return secant(0);
+      if (j == 0)
+        return 0.5f * (3.f * secant(0) - slopeInterior(1));
+      if (j == n - 1)
+        return 0.5f * (3.f * secant(n - 2) - slopeInterior(n - 2));
+      return slopeInterior(j);
+    }
+
+    void tessellateSpan(uint32_t i) {
+      TVertex m0, m1;
+      spanTangents(i, m0, m1);
+      const TVertex& p0 = points[i];
+      const TVertex& p1 = points[i + 1];
+      internal::hermite(basis, nsteps, p0.x, m0.x, p1.x, m1.x, &cx[i * nsteps]);
+      internal::hermite(basis, nsteps, p0.y, m0.y, p1.y, m1.y, &cy[i * nsteps]);
+    }
+
+    // Updates the curve points of the spans affected by the changes in new_points,
+    // and calls emit(begin, end) for each range of curve points whose vertices
+    // have to be generated again. Each range is extended by margin curve points
+    template< typename TEmitFn >
+    void tessellate(const TVertex* new_points, uint32_t n, uint32_t margin, TEmitFn emit) {
+      dirty_ranges.clear();
+
+      if (n != points.size() || all_dirty) {
+        points.assign(new_points, new_points + n);
+        point_changed.assign(n, 1);
+        span_dirty.assign(n > 1 ? n - 1 : 0, 1);
+        basis.resize(nsteps);
+        uint32_t ncurve = numCurvePoints();
+        cx.resize(ncurve);
+        cy.resize(ncurve);
+        verts.resize(2 * ncurve);
+        all_dirty = false;
+      }
+      else {
+        // Compare and keep the new points
+        parallel::forRange(n, [&](uint32_t begin, uint32_t end, uint32_t) {
+          uint32_t k = begin;
+#if D3CPP_USE_SSE
+          for (; k + 2 <= end; k += 2) {
+            __m128 a = _mm_loadu_ps(&new_points[k].x);
+            __m128 b = _mm_loadu_ps(&points[k].x);
+            int mask = _mm_movemask_ps(_mm_cmpneq_ps(a, b));
+            point_changed[k] = (mask & 3) != 0;
+            point_changed[k + 1] = (mask & 12) != 0;
+            _mm_storeu_ps(&points[k].x, a);
+          }
+#endif
+          for (; k < end; ++k) {
+            point_changed[k] = new_points[k].x != points[k].x || new_points[k].y != points[k].y;
+            points[k] = new_points[k];
+          }
+        }, 1 << 14);
+
+        // The tangents of the curves depend on the neighbours
+        uint32_t before = curve_type == CURVE_LINEAR ? 0 : 1;
+        uint32_t after = curve_type == CURVE_LINEAR ? 1 : 2;
+        uint32_t nspans = n > 1 ? n - 1 : 0;
+        parallel::forRange(nspans, [&](uint32_t begin, uint32_t end, uint32_t) {
+          for (uint32_t i = begin; i < end; ++i) {
+            uint32_t k0 = i > before ? i - before : 0;
+            uint32_t k1 = i + after < n - 1 ? i + after : n - 1;
+            uint8_t dirty = 0;
+            for (uint32_t k = k0; k <= k1; ++k)
+              dirty |= point_changed[k];
+            span_dirty[i] = dirty;
+          }
+        }, 1 << 14);
+      }
+
+      uint32_t nspans = n > 1 ? n - 1 : 0;
+      uint32_t ncurve = numCurvePoints();
+      if (n == 1) {
+        if (point_changed[0]) {
+          cx[0] = points[0].x;
+          cy[0] = points[0].y;
+          emit(0, 1);
+          dirty_ranges.push_back(TRange{ 0, 2 });
+        }
+        return;
+      }
+
+      parallel::forRange(nspans, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i)
+          if (span_dirty[i])
+            tessellateSpan(i);
+      }, 1 << 12);
+      // The last curve point is not generated by any span
+      if (nspans && span_dirty[nspans - 1]) {
+        cx[ncurve - 1] = points[n - 1].x;
+        cy[ncurve - 1] = points[n - 1].y;
+      }
+
+      // Ranges of consecutive dirty spans
+      uint32_t i = 0;
+      while (i < nspans) {
+        if (!span_dirty[i]) {
+          ++i;
+          continue;
+        }
+        uint32_t s0 = i;
+        while (i < nspans && span_dirty[i])
+          ++i;
+        uint32_t begin = s0 * nsteps;
+        uint32_t end = i * nsteps + 1;
+        begin = begin > margin ? begin - margin : 0;
+        end = end + margin < ncurve ? end + margin : ncurve;
+        parallel::forRange(end - begin, [&](uint32_t b, uint32_t e, uint32_t) {
+          emit(begin + b, begin + e);
+        }, 1 << 14);
+        // Join with the previous range when they overlap
+        if (!dirty_ranges.empty() && dirty_ranges.back().first + dirty_ranges.back().count >= 2 * begin)
+          dirty_ranges.back().count = 2 * end - dirty_ranges.back().first;
+        else
+          dirty_ranges.push_back(TRange{ 2 * begin, 2 * (end - begin) });
+      }
+    }
+
+  public:
+
+    // Curves other than linear use subdivisions curve points per span
+    void curve(eCurve new_curve, uint32_t subdivisions = 8) {
+      assert(subdivisions > 0);
+      curve_type = new_curve;
+      nsteps = new_curve == CURVE_LINEAR ? 1 : subdivisions;
+      all_dirty = true;
+    }
+
+    // To draw as a triangle strip
+    const std::vector< TVertex >& vertices() const { return verts; }
+
+    // Vertices changed in the last update
+    const std::vector< TRange >& dirtyRanges() const { return dirty_ranges; }
+  };
+
+  // ---------------------------------------------------------
+  class CLine : public CCurve {
+    float half_width = 0.5f;
+  public:
+    CLine& width(float new_width) {
+      half_width = new_width * 0.5f;
+      all_dirty = true;
+      return *this;
+    }
+    CLine& curve(eCurve new_curve, uint32_t subdivisions = 8) {
+      CCurve::curve(new_curve, subdivisions);
+      return *this;
+    }
+    void update(const TVertex* new_points, uint32_t n) {
+      // The normals depend on the neighbour curve points
+      tessellate(new_points, n, 1, [this](uint32_t begin, uint32_t end) {
+        internal::extrude(cx.data(), cy.data(), (uint32_t)cx.size(), begin, end, half_width, verts.data());
+      });
+    }
+  };
+
+  // ---------------------------------------------------------
+  class CArea : public CCurve {
+    float baseline_y = 0.f;
+  public:
+    CArea& baseline(float new_baseline) {
+      baseline_y = new_baseline;
+      all_dirty = true;
+      return *this;
+    }
+    CArea& curve(eCurve new_curve, uint32_t subdivisions = 8) {
+      CCurve::curve(new_curve, subdivisions);
+      return *this;
+    }
+    void update(const TVertex* new_points, uint32_t n) {
+      tessellate(new_points, n, 0, [this](uint32_t begin, uint32_t end) {
+        internal::fill(cx.data(), cy.data(), begin, end, baseline_y, verts.data());
+      });
+    }
+  };
+
+  // ---------------------------------------------------------
+  // Angles in radians, clockwise from 12 o'clock as in d3
+  struct TArc {
+    float start_angle;
+    float end_angle;
+    float inner_radius;
+    float outer_radius;
+  };
+
+  // All the arcs in a single strip. Each arc takes verticesPerArc() vertices,
+  // starting and ending with a repeated vertex to join with the next arc
+  class CArc {
+    float                  center_x = 0.f;
+    float                  center_y = 0.f;
+    uint32_t               nsteps = 32;
+    bool                   all_dirty = true;
+    std::vector< TArc >    arcs;
+    std::vector< TVertex > verts;
+    std::vector< TRange >  dirty_ranges;
+
+    void generate(uint32_t idx) {
+      const TArc& a = arcs[idx];
+      TVertex* out = verts.data() + idx * verticesPerArc();
+      float step = (a.end_angle - a.start_angle) / (float)nsteps;
+      for (uint32_t k = 0; k <= nsteps; ++k) {
+        float angle = a.start_angle + step * (float)k;
+        float s = sinf(angle);
+        float c = -cosf(angle);
+        out[1 + 2 * k].x = center_x + s * a.outer_radius;
+        out[1 + 2 * k].y = center_y + c * a.outer_radius;
+        out[2 + 2 * k].x = center_x + s * a.inner_radius;
+        out[2 + 2 * k].y = center_y + c * a.inner_radius;
+      }
+      out[0] = out[1];
+      out[verticesPerArc() - 1] = out[verticesPerArc() - 2];
+    }
+
+  public:
+    CArc& center(float x, float y) {
+      center_x = x;
+      center_y = y;
+      all_dirty = true;
+      return *this;
+    }
+
+    CArc& subdivisions(uint32_t new_nsteps) {
+      assert(new_nsteps > 0);
+      nsteps = new_nsteps;
+      all_dirty = true;
+      return *this;
+    }
+
+    uint32_t verticesPerArc() const { return 2 * (nsteps + 1) + 2; }
+
+    void update(const TArc* new_arcs, uint32_t n) {
+      dirty_ranges.clear();
+      bool all = all_dirty || n != arcs.size();
+      if (all) {
+        arcs.assign(new_arcs, new_arcs + n);
+        verts.resize(n * verticesPerArc());
+        all_dirty = false;
+      }
+      uint32_t nverts = verticesPerArc();
+      for (uint32_t i = 0; i < n; ++i) {
+        const TArc& a = new_arcs[i];
+        const TArc& b = arcs[i];
+        if (!all && a.start_angle == b.start_angle && a.end_angle == b.end_angle
+          && a.inner_radius == b.inner_radius && a.outer_radius == b.outer_radius)
+          continue;
+        arcs[i] = a;
+        generate(i);
+        if (!dirty_ranges.empty() && dirty_ranges.back().first + dirty_ranges.back().count == i * nverts)
+          dirty_ranges.back().count += nverts;
+        else
+          dirty_ranges.push_back(TRange{ i * nverts, nverts });
+      }
+    }
+
+    const std::vector< TVertex >& vertices() const { return verts; }
+    const std::vector< TRange >& dirtyRanges() const { return dirty_ranges; }
+  };
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef INC_SIMD_H_
+#define INC_SIMD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// SSE2 is always available on x64, and can be enabled in win32 with /arch:SSE2
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define D3CPP_USE_SSE 1
+#include <emmintrin.h>
+#else
+#define D3CPP_USE_SSE 0
+#endif
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+namespace simd {
+
+  // Alignment required by the 4-wide kernels
+  static const size_t default_alignment = 16;
+
+  // ---------------------------------------------------------
+  // Allocator for std::vector guaranteeing the buffer start is aligned.
+  // malloc only guarantees 8 bytes in win32
+  template< typename T, size_t Alignment = default_alignment >
+  struct TAlignedAllocator {
+    typedef T value_type;
+
+    template< typename U >
+    struct rebind { typedef TAlignedAllocator< U, Alignment > other; };
+
+    TAlignedAllocator() = default;
+    template< typename U >
+    TAlignedAllocator(const TAlignedAllocator< U, Alignment >&) {}
+
+    T* allocate(size_t n) {
+      void* p = nullptr;
+#ifdef _MSC_VER
+      p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+      if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+        p = nullptr;
+#endif
+      if (!p)
+        throw std::bad_alloc();
+      return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) {
+#ifdef _MSC_VER
+      _aligned_free(p);
+#else
+      free(p);
+#endif
+    }
+
+    template< typename U >
+    bool operator == (const TAlignedAllocator< U, Alignment >&) const { return true; }
+    template< typename U >
+    bool operator != (const TAlignedAllocator< U, Alignment >&) const { return false; }
+  };
+
+  // Round up offset to the next multiple of alignment (power of two)
+  inline size_t alignUp(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+  }
+
+}
+
+#endif
@@ -0,0 +1,671 @@
+#ifndef INC_TRACE_H_
+#define INC_TRACE_H_
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <typeinfo>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "ease.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+
+  Binary trace of the calls to a CDataVisualizer, to replay real sessions.
+
+  File:
+    THeader
+    Records, each one:
+      TRecordHeader
+      payload, padded to 8 bytes
+
+  Payloads:
+    DATA            : uint32 count, uint32 unused, count * TUserData
+    UPDATE          : float dt, uint32 unused
+    TRANSITION_SET  : TTransitionSet, then count * TIndex user_data_idx,
+                      count * float delay, count * float duration,
+                      count * value_bytes with the final values
+    TRANSITION_REMOVE : uint32 first_tween_idx, uint32 count
+    SELECTION_SET   : TSelectionSet, then count * TIndex user_data_idx,
+                      count * value_bytes with the values
+
+  Only trivially copyable user data and prop types can be recorded.
+  The visuals created by CSelection::append are not recorded, the replay
+  starts from default constructed visuals.
+
+*/
+
+namespace trace {
+
+  static const uint32_t magic = 0x52543344;     // 'D3TR'
+  static const uint32_t version = 3;
+
+  enum eRecordType {
+    DATA = 1
+  , UPDATE
+  , TRANSITION_SET
+  , TRANSITION_REMOVE
+  , SELECTION_SET
+  };
+
+  struct THeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t user_data_bytes;
+    uint32_t unused;
+  };
+
+  struct TRecordHeader {
+    uint32_t type;              // eRecordType
+    uint32_t bytes;             // Size of the payload, excluding the padding
+  };
+
+  struct TTransitionSet {
+    uint32_t prop_type_id;      // See propTypeId
+    uint32_t prop_id;
+    uint32_t ease_type;         // ease::eType, EASE_TYPES_COUNT for custom functions
+    uint32_t remove_on_end;
+    uint32_t chained;           // Initial values read when the tween starts
+    uint32_t count;
+    uint32_t value_bytes;
+  };
+
+  struct TSelectionSet {
+    uint32_t prop_type_id;
+    uint32_t prop_id;
+    uint32_t count;
+    uint32_t value_bytes;
+  };
+
+  inline uint32_t paddedSize(uint32_t bytes) {
+    return (bytes + 7) & ~7u;
+  }
+
+  // Identifies the prop type across runs of the same binary
+  template< typename TPropType >
+  uint32_t propTypeId() {
+    uint32_t h = 2166136261u;
+    for (const char* p = typeid(TPropType).name(); *p; ++p)
+      h = (h ^ (uint8_t)*p) * 16777619u;
+    return h;
+  }
+
+  // -------------------------------------------------------
+  class CRecorder {
+    FILE*    f = nullptr;
+    uint32_t pending_bytes = 0;
+
+  public:
+
+    ~CRecorder() {
+      close();
+    }
+
+    bool open(const char* filename, uint32_t user_data_bytes) {
+      close();
+      f = fopen(filename, "wb");
+      if (!f)
+        return false;
+      THeader header = { magic, version, user_data_bytes, 0 };
+      fwrite(&header, sizeof(header), 1, f);
+      return true;
+    }
+
+    void close() {
+      assert(pending_bytes == 0);
+      if (f) {
+        fclose(f);
+        f = nullptr;
+      }
+    }
+
+    bool isOpen() const { return f != nullptr; }
+
+    // A record is written with begin, a set of writes adding exactly 'bytes', and end
+    void begin(eRecordType type, uint32_t bytes) {
+      assert(f && pending_bytes == 0);
+      TRecordHeader rh = { (uint32_t)type, bytes };
+      fwrite(&rh, sizeof(rh), 1, f);
+      pending_bytes = bytes;
+    }
+
+    void write(const void* data, uint32_t bytes) {
+      assert(bytes <= pending_bytes);
+      if (bytes)
+        fwrite(data, bytes, 1, f);
+      pending_bytes -= bytes;
+    }
+
+    void end(uint32_t bytes) {
+      assert(pending_bytes == 0);
+      static const uint8_t zeros[8] = { 0 };
+      fwrite(zeros, paddedSize(bytes) - bytes, 1, f);
+    }
+
+    // -----------------------------------------------------
+    void recordUpdate(float dt) {
+      uint32_t unused = 0;
+      begin(UPDATE, sizeof(float) + sizeof(uint32_t));
+      write(&dt, sizeof(float));
+      write(&unused, sizeof(uint32_t));
+      end(sizeof(float) + sizeof(uint32_t));
+    }
+
+    void recordRemove(uint32_t first_tween_idx, uint32_t count) {
+      begin(TRANSITION_REMOVE, 2 * sizeof(uint32_t));
+      write(&first_tween_idx, sizeof(uint32_t));
+      write(&count, sizeof(uint32_t));
+      end(2 * sizeof(uint32_t));
+    }
+
+    // get_entry(i, user_data_idx, delay, duration, value) must return the i-th tween
+    template< typename TPropType, typename TIndex, typename TFn >
+    void recordTransitionSet(const TTransitionSet& ts, TFn get_entry) {
+      recordTransitionSet< TPropType, TIndex >(ts, get_entry, std::is_trivially_copyable< TPropType >());
+    }
+
+    template< typename TPropType, typename TIndex, typename TFn >
+    void recordTransitionSet(const TTransitionSet& ts, TFn get_entry, std::true_type) {
+      assert(ts.value_bytes == sizeof(TPropType));
+      uint32_t bytes = (uint32_t)(sizeof(ts) + ts.count * (sizeof(TIndex) + 2 * sizeof(float) + sizeof(TPropType)));
+      begin(TRANSITION_SET, bytes);
+      write(&ts, sizeof(ts));
+      TIndex    user_data_idx;
+      float     delay, duration;
+      TPropType value;
+      for (uint32_t i = 0; i < ts.count; ++i) {
+        get_entry(i, user_data_idx, delay, duration, value);
+        write(&user_data_idx, sizeof(TIndex));
+      }
+      for (uint32_t i = 0; i < ts.count; ++i) {
+        get_entry(i, user_data_idx, delay, duration, value);
+        write(&delay, sizeof(float));
+      }
+      for (uint32_t i = 0; i < ts.count; ++i) {
+        get_entry(i, user_data_idx, delay, duration, value);
+        write(&duration, sizeof(float));
+      }
+      for (uint32_t i = 0; i < ts.count; ++i) {
+        get_entry(i, user_data_idx, delay, duration, value);
+        write(&value, sizeof(TPropType));
+      }
+      end(bytes);
+    }
+
+    template< typename TPropType, typename TIndex, typename TFn >
+    void recordTransitionSet(const TTransitionSet&, TFn, std::false_type) {
+      assert(!"Prop types must be trivially copyable to be recorded");
+    }
+
+    // get_entry(i, user_data_idx, value) must return the i-th value written
+    template< typename TPropType, typename TIndex, typename TFn >
+    void recordSelectionSet(const TSelectionSet& ss, TFn get_entry) {
+      recordSelectionSet< TPropType, TIndex >(ss, get_entry, std::is_trivially_copyable< TPropType >());
+    }
+
+    template< typename TPropType, typename TIndex, typename TFn >
+    void recordSelectionSet(const TSelectionSet& ss, TFn get_entry, std::true_type) {
+      assert(ss.value_bytes == sizeof(TPropType));
+      uint32_t bytes = (uint32_t)(sizeof(ss) + ss.count * (sizeof(TIndex) + sizeof(TPropType)));
+      begin(SELECTION_SET, bytes);
+      write(&ss, sizeof(ss));
+      TIndex    user_data_idx;
+      TPropType value;
+      for (uint32_t i = 0; i < ss.count; ++i) {
+        get_entry(i, user_data_idx, value);
+        write(&user_data_idx, sizeof(TIndex));
+      }
+      for (uint32_t i = 0; i < ss.count; ++i) {
+        get_entry(i, user_data_idx, value);
+        write(&value, sizeof(TPropType));
+      }
+      end(bytes);
+    }
+
+    template< typename TPropType, typename TIndex, typename TFn >
+    void recordSelectionSet(const TSelectionSet&, TFn, std::false_type) {
+      assert(!"Prop types must be trivially copyable to be recorded");
+    }
+
+    template< typename TUserData >
+    void recordData(const std::vector< TUserData >& new_data) {
+      recordData(new_data, std::is_trivially_copyable< TUserData >());
+    }
+
+    template< typename TUserData >
+    void recordData(const std::vector< TUserData >& new_data, std::true_type) {
+      uint32_t count[2] = { (uint32_t)new_data.size(), 0 };
+      uint32_t bytes = (uint32_t)(sizeof(count) + new_data.size() * sizeof(TUserData));
+      begin(DATA, bytes);
+      write(count, sizeof(count));
+      write(new_data.data(), (uint32_t)(new_data.size() * sizeof(TUserData)));
+      end(bytes);
+    }
+
+    template< typename TUserData >
+    void recordData(const std::vector< TUserData >&, std::false_type) {
+      assert(!"User data must be trivially copyable to be recorded");
+    }
+  };
+
+  // -------------------------------------------------------
+  // Read only view of a file. Only a window of the file is mapped at a time,
+  // so huge traces can be read even in 32 bits
+  class CMappedFile {
+#ifdef _WIN32
+    HANDLE         file = INVALID_HANDLE_VALUE;
+    HANDLE         mapping = nullptr;
+#else
+    int            fd = -1;
+#endif
+    uint64_t       file_size = 0;
+    uint64_t       granularity = 0;
+    const uint8_t* window = nullptr;
+    uint64_t       window_offset = 0;
+    size_t         window_size = 0;
+
+    static const size_t min_window_size = 64 << 20;
+
+    void unmapWindow() {
+      if (!window)
+        return;
+#ifdef _WIN32
+      UnmapViewOfFile(window);
+#else
+      munmap((void*)window, window_size);
+#endif
+      window = nullptr;
+      window_size = 0;
+    }
+
+  public:
+
+    ~CMappedFile() {
+      close();
+    }
+
+    bool open(const char* filename) {
+      close();
+#ifdef _WIN32
+      file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      if (file == INVALID_HANDLE_VALUE)
+        return false;
+      LARGE_INTEGER sz;
+      GetFileSizeEx(file, &sz);
+      file_size = (uint64_t)sz.QuadPart;
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (!mapping) {
+        close();
+        return false;
+      }
+      SYSTEM_INFO si;
+      GetSystemInfo(&si);
+      granularity = si.dwAllocationGranularity;
+#else
+      fd = ::open(filename, O_RDONLY);
+      if (fd < 0)
+        return false;
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        close();
+        return false;
+      }
+      file_size = (uint64_t)st.st_size;
+      granularity = (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+      return true;
+    }
+
+    void close() {
+      unmapWindow();
+#ifdef _WIN32
+      if (mapping)
+        CloseHandle(mapping);
+      if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+      mapping = nullptr;
+      file = INVALID_HANDLE_VALUE;
+#else
+      if (fd >= 0)
+        ::close(fd);
+      fd = -1;
+#endif
+      file_size = 0;
+    }
+
+    uint64_t size() const { return file_size; }
+
+    // Returns the address of the range [offset, offset+bytes) of the file, or null
+    // if out of bounds. Invalidates the pointers returned by previous calls
+    const uint8_t* view(uint64_t offset, size_t bytes) {
+      if (offset + bytes > file_size)
+        return nullptr;
+
+      if (!window || offset < window_offset || offset + bytes > window_offset + window_size) {
+        unmapWindow();
+        window_offset = offset - offset % granularity;
+        uint64_t wanted = (offset - window_offset) + bytes;
+        if (wanted < min_window_size)
+          wanted = min_window_size;
+        if (window_offset + wanted > file_size)
+          wanted = file_size - window_offset;
+        window_size = (size_t)wanted;
+#ifdef _WIN32
+        window = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(window_offset >> 32), (DWORD)window_offset, window_size);
+#else
+        void* addr = mmap(nullptr, window_size, PROT_READ, MAP_PRIVATE, fd, (off_t)window_offset);
+        window = (addr == MAP_FAILED) ? nullptr : (const uint8_t*)addr;
+        if (window)
+          madvise(addr, window_size, MADV_SEQUENTIAL);
+#endif
+        if (!window) {
+          window_size = 0;
+          return nullptr;
+        }
+      }
+      return window + (offset - window_offset);
+    }
+  };
+
+  // -------------------------------------------------------
+  // Iterates the records of a trace file
+  class CReader {
+    CMappedFile file;
+    THeader     header;
+    uint64_t    offset = 0;
+
+  public:
+
+    struct TRecord {
+      eRecordType    type;
+      uint32_t       bytes;
+      const uint8_t* payload;   // Valid until the next call to next
+    };
+
+    bool open(const char* filename) {
+      if (!file.open(filename))
+        return false;
+      const uint8_t* addr = file.view(0, sizeof(THeader));
+      if (!addr)
+        return false;
+      memcpy(&header, addr, sizeof(THeader));
+      if (header.magic != magic || header.version != version)
+        return false;
+      offset = sizeof(THeader);
+      return true;
+    }
+
+    const THeader& getHeader() const { return header; }
+
+    bool next(TRecord& record) {
+      const uint8_t* addr = file.view(offset, sizeof(TRecordHeader));
+      if (!addr)
+        return false;
+      TRecordHeader rh;
+      memcpy(&rh, addr, sizeof(rh));
+      addr = file.view(offset, sizeof(TRecordHeader) + rh.bytes);
+      if (!addr)
+        return false;
+      record.type = (eRecordType)rh.type;
+      record.bytes = rh.bytes;
+      record.payload = addr + sizeof(TRecordHeader);
+      offset += sizeof(TRecordHeader) + paddedSize(rh.bytes);
+      return true;
+    }
+  };
+
+  // -------------------------------------------------------
+  struct TReplayStats {
+    struct TCounter {
+      uint32_t count = 0;
+      double   seconds = 0.;
+      double   max_seconds = 0.;
+      void add(double s) {
+        ++count;
+        seconds += s;
+        if (s > max_seconds)
+          max_seconds = s;
+      }
+    };
+    TCounter data;
+    TCounter update;
+    TCounter transition_set;
+    TCounter transition_remove;
+    TCounter selection_set;
+    uint32_t skipped = 0;         // Records of unknown type or prop type
+    double   total_seconds = 0.;
+
+    void dump() const {
+      printf("Replay: %1.3f s (%d records skipped)\n", total_seconds, skipped);
+      dumpCounter("data", data);
+      dumpCounter("update", update);
+      dumpCounter("transition.set", transition_set);
+      dumpCounter("transition.remove", transition_remove);
+      dumpCounter("selection.set", selection_set);
+    }
+
+    static void dumpCounter(const char* title, const TCounter& c) {
+      printf("  %-18s: %8d calls %10.3f ms total %8.3f us avg %8.3f us max\n"
+        , title, c.count, c.seconds * 1e3
+        , c.count ? c.seconds * 1e6 / c.count : 0.
+        , c.max_seconds * 1e6);
+    }
+  };
+
+  // -------------------------------------------------------
+  // Drives a visualizer from a trace as fast as possible. The prop types used in
+  // the transitions of the trace must be registered with registerPropType
+  template< typename TVisualizer >
+  class CReplayer {
+
+    typedef typename TVisualizer::TUserDataContainer TUserDataContainer;
+    typedef typename TUserDataContainer::value_type  TUserData;
+    typedef typename TVisualizer::TIndex             TIndex;
+    typedef typename TVisualizer::CSelection         CSelection;
+    typedef typename TVisualizer::TVisualizedDataContainer TVisualizedDataContainer;
+    typedef std::chrono::high_resolution_clock       TClock;
+
+    using TReplaySetFn = bool (CReplayer::*)(TVisualizer&, const TTransitionSet&, const uint8_t*);
+    std::unordered_map< uint32_t, TReplaySetFn > set_fns;
+
+    using TReplaySelectionSetFn = bool (CReplayer::*)(TVisualizer&, const TSelectionSet&, const uint8_t*);
+    std::unordered_map< uint32_t, TReplaySelectionSetFn > selection_set_fns;
+
+    TUserDataContainer user_data;     // Reused between DATA records
+
+    // Uses the regular transition api, so the replay costs the same as the original call.
+    // The size of the payload has been checked against ts. Returns false when the
+    // values are not TPropType
+    template< typename TPropType >
+    bool replaySet(TVisualizer& dv, const TTransitionSet& ts, const uint8_t* payload) {
+      if (ts.value_bytes != sizeof(TPropType))
+        return false;
+      const uint8_t* idxs = payload;
+      const uint8_t* delays = idxs + ts.count * sizeof(TIndex);
+      const uint8_t* durations = delays + ts.count * sizeof(float);
+      const uint8_t* values = durations + ts.count * sizeof(float);
+
+      TVisualizedDataContainer sel_idxs(ts.count);
+      memcpy(sel_idxs.data(), idxs, ts.count * sizeof(TIndex));
+      CSelection sel = dv.makeSelection(std::move(sel_idxs));
+
+      auto tr = sel.transition();
+      tr.delay([delays](const TUserData&, TIndex idx) {
+        float v;
+        memcpy(&v, delays + idx * sizeof(float), sizeof(float));
+        return v;
+      });
+      tr.duration([durations](const TUserData&, TIndex idx) {
+        float v;
+        memcpy(&v, durations + idx * sizeof(float), sizeof(float));
+        return v;
+      });
+      tr.ease(ts.ease_type < ease::EASE_TYPES_COUNT ? ease::getFunc(ts.ease_type) : ease::linear);
+      if (ts.remove_on_end)
+        tr.remove();
+      // The recorded delays already include the time to wait for the previous stages
+      tr.chained = ts.chained != 0;
+
+      tr.set(ts.prop_id, [values](const TUserData&, TIndex idx) {
+        TPropType v;
+        memcpy(&v, values + idx * sizeof(TPropType), sizeof(TPropType));
+        return v;
+      });
+      return true;
+    }
+
+    template< typename TPropType >
+    bool replaySelectionSet(TVisualizer& dv, const TSelectionSet& ss, const uint8_t* payload) {
+      if (ss.value_bytes != sizeof(TPropType))
+        return false;
+      const uint8_t* idxs = payload;
+      const uint8_t* values = idxs + ss.count * sizeof(TIndex);
+
+      TVisualizedDataContainer sel_idxs(ss.count);
+      memcpy(sel_idxs.data(), idxs, ss.count * sizeof(TIndex));
+      CSelection sel = dv.makeSelection(std::move(sel_idxs));
+
+      sel.set(ss.prop_id, [values](const TUserData&, TIndex idx) {
+        TPropType v;
+        memcpy(&v, values + idx * sizeof(TPropType), sizeof(TPropType));
+        return v;
+      });
+      return true;
+    }
+
+    // The payload of a record must be exactly what its counts tell, so truncated
+    // or corrupted traces are skipped instead of read out of bounds
+    static bool hasSize(const CReader::TRecord& record, uint64_t header_bytes, uint32_t count, uint64_t bytes_per_item) {
+      return record.bytes == header_bytes + count * bytes_per_item;
+    }
+
+  public:
+
+    template< typename TPropType >
+    void registerPropType() {
+      set_fns[propTypeId<TPropType>()] = &CReplayer::template replaySet<TPropType>;
+      selection_set_fns[propTypeId<TPropType>()] = &CReplayer::template replaySelectionSet<TPropType>;
+    }
+
+    bool run(const char* filename, TVisualizer& dv, TReplayStats& stats) {
+      CReader reader;
+      if (!reader.open(filename))
+        return false;
+      if (reader.getHeader().user_data_bytes != sizeof(TUserData))
+        return false;
+
+      auto t_start = TClock::now();
+      CReader::TRecord record;
+      while (reader.next(record)) {
+        auto t0 = TClock::now();
+
+        switch (record.type) {
+
+        case DATA: {
+          uint32_t count = 0;
+          if (record.bytes >= sizeof(uint32_t))
+            memcpy(&count, record.payload, sizeof(uint32_t));
+          if (!hasSize(record, 2 * sizeof(uint32_t), count, sizeof(TUserData))) {
+            ++stats.skipped;
+            break;
+          }
+          user_data.resize(count);
+          memcpy(user_data.data(), record.payload + 2 * sizeof(uint32_t), count * sizeof(TUserData));
+          t0 = TClock::now();
+          dv.data(user_data);
+          stats.data.add(secondsSince(t0));
+          break; }
+
+        case UPDATE: {
+          if (record.bytes != sizeof(float) + sizeof(uint32_t)) {
+            ++stats.skipped;
+            break;
+          }
+          float dt;
+          memcpy(&dt, record.payload, sizeof(float));
+          t0 = TClock::now();
+          dv.update(dt);
+          stats.update.add(secondsSince(t0));
+          break; }
+
+        case TRANSITION_SET: {
+          TTransitionSet ts;
+          if (record.bytes < sizeof(ts)) {
+            ++stats.skipped;
+            break;
+          }
+          memcpy(&ts, record.payload, sizeof(ts));
+          auto it = set_fns.find(ts.prop_type_id);
+          if (it == set_fns.end()
+            || !hasSize(record, sizeof(ts), ts.count, sizeof(TIndex) + 2 * sizeof(float) + (uint64_t)ts.value_bytes)
+            || !(this->*it->second)(dv, ts, record.payload + sizeof(ts))) {
+            ++stats.skipped;
+            break;
+          }
+          stats.transition_set.add(secondsSince(t0));
+          break; }
+
+        case TRANSITION_REMOVE: {
+          if (record.bytes != 2 * sizeof(uint32_t)) {
+            ++stats.skipped;
+            break;
+          }
+          uint32_t args[2];
+          memcpy(args, record.payload, sizeof(args));
+          auto& tweens = dv.tweens;
+          for (uint32_t i = args[0]; i < args[0] + args[1] && i < tweens.size(); ++i)
+            tweens[i].remove_on_end = true;
+          stats.transition_remove.add(secondsSince(t0));
+          break; }
+
+        case SELECTION_SET: {
+          TSelectionSet ss;
+          if (record.bytes < sizeof(ss)) {
+            ++stats.skipped;
+            break;
+          }
+          memcpy(&ss, record.payload, sizeof(ss));
+          auto it = selection_set_fns.find(ss.prop_type_id);
+          if (it == selection_set_fns.end()
+            || !hasSize(record, sizeof(ss), ss.count, sizeof(TIndex) + (uint64_t)ss.value_bytes)
+            || !(this->*it->second)(dv, ss, record.payload + sizeof(ss))) {
+            ++stats.skipped;
+            break;
+          }
+          stats.selection_set.add(secondsSince(t0));
+          break; }
+
+        default:
+          ++stats.skipped;
+        }
+      }
+      stats.total_seconds = secondsSince(t_start);
+      return true;
+    }
+
+    static double secondsSince(TClock::time_point t0) {
+      return std::chrono::duration< double >(TClock::now() - t0).count();
+    }
+  };
+
+}
+
+#endif
@@ -1,27 +1,358 @@
 #ifndef INC_TWEEN_FUNCTIONS_H_
 #define INC_TWEEN_FUNCTIONS_H_
 
+#include <cstdint>
+#include <cstring>
+#include <math.h>
+#include "simd.h"
+
 namespace tween {
 
   // Generic description on how to blend two elems of type TDataType
   template< typename TDataType >
-  TDataType tweenData(float t, TDataType s, TDataType d);
+  TDataType tweenData(float t, const TDataType& s, const TDataType& d);
 
   // Implementation for the floats
   template<>
-  float tweenData<float>(float t, float s, float d) {
+  inline float tweenData<float>(float t, const float& s, const float& d) {
     return s * (1.f - t) + d * t;
   }
 
 #ifdef INC_GEOMETRY_H_
   // Implementation for the VEC3
   template<>
-  VEC3 tweenData<VEC3>(float t, VEC3 s, VEC3 d) {
+  inline VEC3 tweenData<VEC3>(float t, const VEC3& s, const VEC3& d) {
     return s * (1.f - t) + d * t;
   }
 #endif
 
-}
+  // ---------------------------------------------------------
+  // Built-in attribute types. vec3/vec4/quat are 16 bytes aligned so the
+  // tween kernels can blend them with a single 4-wide register
+  struct alignas(8) TVec2 {
+    float x, y;
+  };
+
+  // The fourth lane is padding, and is ignored by the kernels
+  struct alignas(16) TVec3 {
+    float x, y, z;
+  };
+
+  struct alignas(16) TVec4 {
+    float x, y, z, w;
+  };
+
+  // Blended using slerp
+  struct alignas(16) TQuat {
+    float x, y, z, w;
+  };
+
+  // Cheaper, normalized lerp. Fine when the rotations are close
+  struct alignas(16) TQuatNlerp : public TQuat {
+  };
+
+  // 8 bits per channel color. Blended directly on the sRGB values
+  struct alignas(4) TRGBA {
+    uint8_t r, g, b, a;
+  };
+
+  // Same storage, but blended in linear space
+  struct TRGBALinear : public TRGBA {
+  };
 
+  // Same storage, but blended in CIE Lab space
+  struct TRGBALab : public TRGBA {
+  };
+
+  namespace internal {
+
+#if D3CPP_USE_SSE
+    inline __m128 lerp4(float t, __m128 s, __m128 d) {
+      __m128 vt = _mm_set1_ps(t);
+      return _mm_add_ps(s, _mm_mul_ps(_mm_sub_ps(d, s), vt));
+    }
+
+    // x, y, z and 0 in the padding lane, which might hold NaNs or denormals
+    inline __m128 loadVec3(const float* xyz) {
+      return _mm_and_ps(_mm_load_ps(xyz), _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+    }
+#endif
+
+    // ---------------------------------------------------------
+    // Blends both quaternions with weights ws and wd, and renormalizes when required
+    template< typename TQ >
+    TQ blendQuat(float ws, const TQ& s, float wd, const TQ& d, bool normalize) {
+      TQ q;
+#if D3CPP_USE_SSE
+      __m128 r = _mm_add_ps(_mm_mul_ps(_mm_load_ps(&s.x), _mm_set1_ps(ws))
+                          , _mm_mul_ps(_mm_load_ps(&d.x), _mm_set1_ps(wd)));
+      if (normalize) {
+        __m128 sq = _mm_mul_ps(r, r);
+        sq = _mm_add_ps(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2, 3, 0, 1)));
+        sq = _mm_add_ps(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(1, 0, 3, 2)));
+        r = _mm_div_ps(r, _mm_sqrt_ps(sq));
+      }
+      _mm_store_ps(&q.x, r);
+#else
+      q.x = s.x * ws + d.x * wd;
+      q.y = s.y * ws + d.y * wd;
+      q.z = s.z * ws + d.z * wd;
+      q.w = s.w * ws + d.w * wd;
+      if (normalize) {
+        float inv_len = 1.f / sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+        q.x *= inv_len;
+        q.y *= inv_len;
+        q.z *= inv_len;
+        q.w *= inv_len;
+      }
 #endif
+      return q;
+    }
+
+    inline float dotQuat(const TQuat& s, const TQuat& d) {
+      return s.x * d.x + s.y * d.y + s.z * d.z + s.w * d.w;
+    }
+
+    // ---------------------------------------------------------
+    // sRGB <-> linear conversions using lookup tables
+    struct TSrgbToLinearTable {
+      float values[256];
+      TSrgbToLinearTable() {
+        for (int i = 0; i < 256; ++i) {
+          float c = i / 255.f;
+          values[i] = (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+      }
+    };
+
+    inline const float* srgbToLinearTable() {
+      static const TSrgbToLinearTable table;
+      return table.values;
+    }
 
+    static const int linear_to_srgb_entries = 4096;
+    struct TLinearToSrgbTable {
+      uint8_t values[linear_to_srgb_entries];
+      TLinearToSrgbTable() {
+        for (int i = 0; i < linear_to_srgb_entries; ++i) {
+          float l = i / (float)(linear_to_srgb_entries - 1);
+          float c = (l <= 0.0031308f) ? l * 12.92f : 1.055f * powf(l, 1.f / 2.4f) - 0.055f;
+          values[i] = (uint8_t)(c * 255.f + 0.5f);
+        }
+      }
+    };
+
+    inline const uint8_t* linearToSrgbTable() {
+      static const TLinearToSrgbTable table;
+      return table.values;
+    }
+
+    inline uint8_t linearToSrgb(float l) {
+      if (l <= 0.f) return 0;
+      if (l >= 1.f) return 255;
+      return linearToSrgbTable()[(int)(l * (linear_to_srgb_entries - 1) + 0.5f)];
+    }
+
+    inline uint8_t lerpChannel(float t, uint8_t s, uint8_t d) {
+      return (uint8_t)(s + (d - s) * t + 0.5f);
+    }
+
+    // ---------------------------------------------------------
+    // CIE Lab using the D65 white point
+    struct TLab {
+      float l, a, b;
+    };
+
+    inline float labF(float v) {
+      return v > 0.008856452f ? cbrtf(v) : v * 7.787037f + 4.f / 29.f;
+    }
+
+    inline float labFInv(float v) {
+      return v > 0.206896552f ? v * v * v : (v - 4.f / 29.f) / 7.787037f;
+    }
+
+    inline TLab rgbToLab(const TRGBA& c) {
+      const float* to_linear = srgbToLinearTable();
+      float r = to_linear[c.r], g = to_linear[c.g], b = to_linear[c.b];
+      float x = labF((0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f);
+      float y = labF( 0.2126729f * r + 0.7151522f * g + 0.0721750f * b);
+      float z = labF((0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f);
+      return TLab{ 116.f * y - 16.f, 500.f * (x - y), 200.f * (y - z) };
+    }
+
+    inline TRGBA labToRgb(const TLab& lab, uint8_t alpha) {
+      float fy = (lab.l + 16.f) / 116.f;
+      float x = 0.95047f * labFInv(fy + lab.a / 500.f);
+      float y = labFInv(fy);
+      float z = 1.08883f * labFInv(fy - lab.b / 200.f);
+      TRGBA c;
+      c.r = linearToSrgb( 3.2404542f * x - 1.5371385f * y - 0.4985314f * z);
+      c.g = linearToSrgb(-0.9692660f * x + 1.8760108f * y + 0.0415560f * z);
+      c.b = linearToSrgb( 0.0556434f * x - 0.2040259f * y + 1.0572252f * z);
+      c.a = alpha;
+      return c;
+    }
+  }
+
+  // ---------------------------------------------------------
+  template<>
+  inline TVec2 tweenData<TVec2>(float t, const TVec2& s, const TVec2& d) {
+    return TVec2{ s.x + (d.x - s.x) * t, s.y + (d.y - s.y) * t };
+  }
+
+  template<>
+  inline TVec3 tweenData<TVec3>(float t, const TVec3& s, const TVec3& d) {
+    TVec3 r;
+#if D3CPP_USE_SSE
+    _mm_store_ps(&r.x, internal::lerp4(t, internal::loadVec3(&s.x), internal::loadVec3(&d.x)));
+#else
+    r.x = s.x + (d.x - s.x) * t;
+    r.y = s.y + (d.y - s.y) * t;
+    r.z = s.z + (d.z - s.z) * t;
+#endif
+    return r;
+  }
+
+  template<>
+  inline TVec4 tweenData<TVec4>(float t, const TVec4& s, const TVec4& d) {
+    TVec4 r;
+#if D3CPP_USE_SSE
+    _mm_store_ps(&r.x, internal::lerp4(t, _mm_load_ps(&s.x), _mm_load_ps(&d.x)));
+#else
+    r.x = s.x + (d.x - s.x) * t;
+    r.y = s.y + (d.y - s.y) * t;
+    r.z = s.z + (d.z - s.z) * t;
+    r.w = s.w + (d.w - s.w) * t;
+#endif
+    return r;
+  }
+
+  // ---------------------------------------------------------
+  // Takes the shortest path. Falls back to nlerp when both are almost the same
+  // rotation to avoid dividing by sin(~0)
+  template<>
+  inline TQuat tweenData<TQuat>(float t, const TQuat& s, const TQuat& d) {
+    float cos_theta = internal::dotQuat(s, d);
+    float sign = 1.f;
+    if (cos_theta < 0.f) {
+      cos_theta = -cos_theta;
+      sign = -1.f;
+    }
+    if (cos_theta > 0.9995f)
+      return internal::blendQuat(1.f - t, s, sign * t, d, true);
+    float theta = acosf(cos_theta);
+    float inv_sin_theta = 1.f / sinf(theta);
+    float ws = sinf((1.f - t) * theta) * inv_sin_theta;
+    float wd = sinf(t * theta) * inv_sin_theta * sign;
+    return internal::blendQuat(ws, s, wd, d, false);
+  }
+
+  template<>
+  inline TQuatNlerp tweenData<TQuatNlerp>(float t, const TQuatNlerp& s, const TQuatNlerp& d) {
+    float sign = internal::dotQuat(s, d) < 0.f ? -1.f : 1.f;
+    return internal::blendQuat(1.f - t, s, sign * t, d, true);
+  }
+
+  // ---------------------------------------------------------
+  // The four channels are blended at once using 8.8 fixed point
+  template<>
+  inline TRGBA tweenData<TRGBA>(float t, const TRGBA& s, const TRGBA& d) {
+    TRGBA r;
+#if D3CPP_USE_SSE
+    int wd = (int)(t * 256.f + 0.5f);
+    if (wd < 0) wd = 0;
+    if (wd > 256) wd = 256;
+    __m128i zero = _mm_setzero_si128();
+    int packed_s, packed_d;
+    memcpy(&packed_s, &s, sizeof(int));
+    memcpy(&packed_d, &d, sizeof(int));
+    __m128i vs = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_s), zero);
+    __m128i vd = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_d), zero);
+    __m128i v = _mm_add_epi16(_mm_mullo_epi16(vs, _mm_set1_epi16((short)(256 - wd)))
+                            , _mm_mullo_epi16(vd, _mm_set1_epi16((short)wd)));
+    v = _mm_srli_epi16(_mm_add_epi16(v, _mm_set1_epi16(128)), 8);
+    int packed = _mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+    memcpy(&r, &packed, sizeof(int));
+#else
+    r.r = internal::lerpChannel(t, s.r, d.r);
+    r.g = internal::lerpChannel(t, s.g, d.g);
+    r.b = internal::lerpChannel(t, s.b, d.b);
+    r.a = internal::lerpChannel(t, s.a, d.a);
+#endif
+    return r;
+  }
+
+  template<>
+  inline TRGBALinear tweenData<TRGBALinear>(float t, const TRGBALinear& s, const TRGBALinear& d) {
+    const float* to_linear = internal::srgbToLinearTable();
+    TRGBALinear r;
+#if D3CPP_USE_SSE
+    __m128 ls = _mm_set_ps(0.f, to_linear[s.b], to_linear[s.g], to_linear[s.r]);
+    __m128 ld = _mm_set_ps(0.f, to_linear[d.b], to_linear[d.g], to_linear[d.r]);
+    float l[4];
+    _mm_storeu_ps(l, internal::lerp4(t, ls, ld));
+#else
+    float l[3] = {
+      to_linear[s.r] + (to_linear[d.r] - to_linear[s.r]) * t
+    , to_linear[s.g] + (to_linear[d.g] - to_linear[s.g]) * t
+    , to_linear[s.b] + (to_linear[d.b] - to_linear[s.b]) * t
+    };
+#endif
+    r.r = internal::linearToSrgb(l[0]);
+    r.g = internal::linearToSrgb(l[1]);
+    r.b = internal::linearToSrgb(l[2]);
+    r.a = internal::lerpChannel(t, s.a, d.a);
+    return r;
+  }
+
+  namespace internal {
+    inline TRGBALab blendLab(float t, const TLab& ls, const TLab& ld, uint8_t as, uint8_t ad) {
+      TLab lr = {
+        ls.l + (ld.l - ls.l) * t
+      , ls.a + (ld.a - ls.a) * t
+      , ls.b + (ld.b - ls.b) * t
+      };
+      TRGBALab r;
+      static_cast<TRGBA&>(r) = labToRgb(lr, lerpChannel(t, as, ad));
+      return r;
+    }
+  }
+
+  template<>
+  inline TRGBALab tweenData<TRGBALab>(float t, const TRGBALab& s, const TRGBALab& d) {
+    return internal::blendLab(t, internal::rgbToLab(s), internal::rgbToLab(d), s.a, d.a);
+  }
+
+  // ---------------------------------------------------------
+  // The two values stored by a tween. prepare is called once both are
+  // known, and blend each frame. Types which can precompute part of the
+  // blend specialize it
+  template< typename TDataType >
+  struct TEndpoints {
+    TDataType value_t0;           // initial value
+    TDataType value_t1;           // final value
+    void prepare() { }
+    TDataType blend(float t) const {
+      return tweenData<TDataType>(t, value_t0, value_t1);
+    }
+  };
+
+  // Converts to Lab once, instead of on every frame
+  template<>
+  struct TEndpoints< TRGBALab > {
+    TRGBALab      value_t0;
+    TRGBALab      value_t1;
+    internal::TLab lab_t0;
+    internal::TLab lab_t1;
+    void prepare() {
+      lab_t0 = internal::rgbToLab(value_t0);
+      lab_t1 = internal::rgbToLab(value_t1);
+    }
+    TRGBALab blend(float t) const {
+      return internal::blendLab(t, lab_t0, lab_t1, value_t0.a, value_t1.a);
+    }
+  };
+
+}
+
+#endif